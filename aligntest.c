@@ -0,0 +1,182 @@
+// Alignment test of the memory management system. Checks that every ptr the
+// allocation functions return is suitably aligned, and that the aligned
+// allocation functions reject the alignments they must.
+//
+// Build and run it against the wrapper like so:
+//
+//      gcc -fPIC -Wall -g -O0 -c memory.c
+//      gcc -fPIC -Wall -g -O0 -c implementation.c
+//      gcc -fPIC -shared -o memory.so memory.o implementation.o -lpthread
+//      gcc -Wall -g -O0 -o aligntest aligntest.c
+//      LD_PRELOAD=`pwd`/memory.so ./aligntest
+//
+// Prints "ok" and exits w/0 on success, else reports each failed check and
+// exits w/1.
+//
+// Author: Dustin Fast
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <errno.h>
+
+#define ALIGN 16                // Alignment every ptr returned must have
+#define SLOTS 1024              // Num of blocks kept live at once
+#define ITERS 200000            // Num of random malloc/calloc/realloc calls
+#define MAX_SZ (256 * 1024)     // Max size of a random request
+
+static int failures = 0;
+
+/* -- fail -- */
+// Reports a failed check.
+static void fail(const char *what, void *ptr, size_t size, size_t align) {
+    printf("FAIL: %s ptr=%p size=%zu align=%zu\n", what, ptr, size, align);
+    failures++;
+}
+
+/* -- check -- */
+// Checks that the given ptr, returned for a request of "size" bytes, is
+//      non-NULL and a multiple of "align", and that all of it is writable.
+static void check(const char *what, void *ptr, size_t size, size_t align) {
+    if (!ptr) {
+        fail(what, ptr, size, align);
+        return;
+    }
+    if ((uintptr_t)ptr % align)
+        fail(what, ptr, size, align);
+    memset(ptr, 0xa5, size);
+}
+
+/* -- rnd -- */
+// Returns: The next num of a xorshift sequence.
+static size_t rnd() {
+    static uint64_t state = 88172645463325252ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (size_t)state;
+}
+
+/* -- rnd_size -- */
+// Returns: A random request size, mostly small, now and then large.
+static size_t rnd_size() {
+    switch (rnd() % 4) {
+        case 0:  return rnd() % 64 + 1;
+        case 1:  return rnd() % 1024 + 1;
+        case 2:  return rnd() % 16384 + 1;
+        default: return rnd() % MAX_SZ + 1;
+    }
+}
+
+/* -- test_random -- */
+// Checks the alignment of random-size malloc, calloc and realloc requests,
+//      keeping up to SLOTS blocks live so they're carved from one another.
+static void test_random() {
+    void *ptrs[SLOTS] = { 0 };
+
+    for (int i = 0; i < ITERS; i++) {
+        int slot = rnd() % SLOTS;
+        size_t size = rnd_size();
+
+        switch (rnd() % 4) {
+            case 0:
+                free(ptrs[slot]);
+                ptrs[slot] = malloc(size);
+                check("malloc", ptrs[slot], size, ALIGN);
+                break;
+            case 1:
+                free(ptrs[slot]);
+                ptrs[slot] = calloc(1, size);
+                check("calloc", ptrs[slot], size, ALIGN);
+                break;
+            case 2:
+                ptrs[slot] = realloc(ptrs[slot], size);
+                check("realloc", ptrs[slot], size, ALIGN);
+                break;
+            default:
+                free(ptrs[slot]);
+                ptrs[slot] = NULL;
+                break;
+        }
+        if (failures)
+            break;
+    }
+
+    for (int i = 0; i < SLOTS; i++)
+        free(ptrs[i]);
+}
+
+/* -- test_aligned -- */
+// Checks memalign, posix_memalign and aligned_alloc at each power of two
+//      alignment up to 1MB, w/random sizes.
+static void test_aligned() {
+    for (size_t align = 1; align <= 1024 * 1024; align *= 2) {
+        for (int i = 0; i < 32; i++) {
+            size_t size = rnd_size();
+            void *ptr = memalign(align, size);
+            check("memalign", ptr, size, align < ALIGN ? ALIGN : align);
+            free(ptr);
+
+            ptr = aligned_alloc(align, size);
+            check("aligned_alloc", ptr, size, align < ALIGN ? ALIGN : align);
+            free(ptr);
+
+            if (align < sizeof(void*))
+                continue;
+            ptr = NULL;
+            if (posix_memalign(&ptr, align, size))
+                fail("posix_memalign", ptr, size, align);
+            else
+                check("posix_memalign", ptr, size, align);
+            free(ptr);
+        }
+    }
+
+    // A non power of two alignment is rounded up by memalign
+    void *ptr = memalign(48, 100);
+    check("memalign(48)", ptr, 100, 64);
+    free(ptr);
+}
+
+/* -- test_einval -- */
+// Checks that posix_memalign and aligned_alloc reject alignments that aren't
+//      powers of two, and posix_memalign those that aren't multiples of
+//      sizeof(void*), w/EINVAL, leaving posix_memalign's result untouched.
+static void test_einval() {
+    static const size_t bad_posix[] = { 0, 1, 2, 4, 3, 24, 48, 100 };
+    static const size_t bad_aligned[] = { 0, 3, 24, 48, 100 };
+    void *untouched = (void*)&failures;
+
+    for (size_t i = 0; i < sizeof(bad_posix) / sizeof(*bad_posix); i++) {
+        size_t align = bad_posix[i];
+        if (align && align % sizeof(void*) == 0 && !(align & (align - 1)))
+            continue;
+        void *ptr = untouched;
+        if (posix_memalign(&ptr, align, 100) != EINVAL || ptr != untouched)
+            fail("posix_memalign EINVAL", ptr, 100, align);
+    }
+
+    for (size_t i = 0; i < sizeof(bad_aligned) / sizeof(*bad_aligned); i++) {
+        size_t align = bad_aligned[i];
+        errno = 0;
+        void *ptr = aligned_alloc(align, 100);
+        if (ptr || errno != EINVAL) {
+            fail("aligned_alloc EINVAL", ptr, 100, align);
+            free(ptr);
+        }
+    }
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    test_random();
+    test_aligned();
+    test_einval();
+
+    if (failures)
+        return 1;
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,381 @@
+// Arena invariant test of the memory management system. Runs a num of threads
+// that allocate, resize and free blocks of mixed sizes in a shared table, so
+// that blocks are often freed by a thread other than the one that allocated
+// them, checking every block's contents as they go. Meanwhile, and again once
+// they're done, it locks each arena in turn and checks its heap's invariants:
+//      - Every mapping's blocks tile it exactly, from its first block to its
+//        fence, w/each block's BLOCK_PREV_USED flag matching the block before.
+//      - No two free blocks are adjacent, and each repeats its size in its
+//        footer.
+//      - Every free block is in the list or tree of its size class, and only
+//        those w/a block are flagged in the class bitmaps. Trees are ordered
+//        per the fit policy, and their priorities form a heap.
+//      - Every stamped free block is on the decay list, and only those, in
+//        stamp order.
+//      - The heap's free and allocated counters match what the walk found.
+// The final checks come once all threads have exited and every block they
+// left in the table is freed. (Blocks libc keeps for its own use, as for
+// reusing exited threads' stacks, still count as allocated.)
+//
+// The checks need the allocator's internals, so this application includes
+// implementation.c itself, and links w/memory.c for the malloc family. Build
+// and run it like so (args: num of threads, and num of ops per thread):
+//
+//      gcc -Wall -g -O2 -o arenatest arenatest.c memory.c -lpthread
+//      ./arenatest 8 30000
+//      MEMORY_ARENAS=4 MEMORY_RESERVE_SZ=32M ./arenatest 8 30000
+//
+// Prints "ok" and exits w/0 on success, else reports the first broken
+// invariant and aborts.
+//
+// Author: Dustin Fast
+
+#include "implementation.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <pthread.h>
+
+#define SLOTS 4096              // Num of blocks shared by all threads
+#define MAX_THREADS 64          // Max num of threads
+
+static void *volatile slots[SLOTS];     // Live blocks, any thread's
+static int ops = 30000;                 // Num of ops per thread
+static volatile int running = 1;        // Zero once the threads are done
+
+/* -- fail -- */
+// Reports a broken invariant and aborts.
+static void fail(const char *what, void *where) {
+    printf("FAIL: %s at %p\n", what, where);
+    abort();
+}
+
+/* -- Heap checks -- */
+
+// What a check of one heap found, for comparing w/its stats
+typedef struct Found {
+    size_t free_sz, free_count;     // Free blocks found in the lists/trees
+    size_t walk_free_sz, walk_free_count;   // And in the physical walk
+    size_t walk_alloc_sz, walk_alloc_count; // Allocated blocks in the walk
+    size_t decay_count, walk_decay_count;   // Stamped blocks, on the decay
+                                            //      list and in the walk
+} Found;
+
+/* -- check_free_block -- */
+// Checks the boundary tags of a free block found in a list or tree.
+static void check_free_block(BlockHead *block) {
+    if (block->size & (BLOCK_USED | BLOCK_MMAPPED))
+        fail("listed block not free", block);
+    if (!(block->size & BLOCK_PREV_USED))
+        fail("listed block follows a free one", block);
+
+    BlockHead *next = block_next(block);
+    if (!(next->size & BLOCK_USED) || next->size & BLOCK_PREV_USED)
+        fail("listed block's next block misflagged", block);
+    if (((size_t*)next)[-1] != block_size(block))
+        fail("listed block's footer", block);
+}
+
+/* -- check_tree -- */
+// Checks the given (sub)tree, whose blocks must all lie between "lo" and
+//      "hi" in tree order (either may be NULL, for no bound).
+static void check_tree(BlockHead *node, size_t idx, BlockHead *lo,
+                       BlockHead *hi, Found *found) {
+    if (!node)
+        return;
+
+    if (tree_index(block_size(node)) != idx)
+        fail("tree block in wrong class", node);
+    if ((lo && !tree_before(lo, node)) || (hi && !tree_before(node, hi)))
+        fail("tree out of order", node);
+    if ((node->left && tree_priority(node->left) > tree_priority(node)) ||
+        (node->right && tree_priority(node->right) > tree_priority(node)))
+        fail("tree priorities not a heap", node);
+
+    check_free_block(node);
+    found->free_sz += block_size(node);
+    found->free_count++;
+
+    check_tree(node->left, idx, lo, node, found);
+    check_tree(node->right, idx, node, hi, found);
+}
+
+/* -- check_list -- */
+// Checks the given free list of class "idx", a bin if "is_bin", else a tree
+//      class kept as a list.
+static void check_list(BlockHead *head, size_t idx, int is_bin,
+                       Found *found) {
+    BlockHead *prev = NULL;
+
+    for (BlockHead *block = head; block; block = block->next) {
+        size_t sz = block_size(block);
+        if (is_bin ? bin_index(sz) != idx || sz >= TREE_MIN_SZ
+                   : tree_index(sz) != idx || sz < TREE_MIN_SZ)
+            fail("listed block in wrong class", block);
+        if (block->prev != prev)
+            fail("list's prev link", block);
+
+        check_free_block(block);
+        found->free_sz += sz;
+        found->free_count++;
+        prev = block;
+    }
+}
+
+/* -- check_decay -- */
+// Checks the heap's decay list.
+static void check_decay(Found *found) {
+    BlockHead *prev = NULL;
+
+    for (BlockHead *block = g_heap->decay_head; block;
+         block = block_tag(block)->next) {
+        DecayTag *tag = block_tag(block);
+        if (block_size(block) < PURGE_MIN_SZ || block->size & BLOCK_ZEROED)
+            fail("decay list block can't be purged", block);
+        if (!tag->stamp || (prev && tag->stamp < block_tag(prev)->stamp))
+            fail("decay list out of stamp order", block);
+        if (tag->prev != prev)
+            fail("decay list's prev link", block);
+
+        check_free_block(block);
+        found->decay_count++;
+        prev = block;
+    }
+
+    if (g_heap->decay_tail != prev)
+        fail("decay list's tail", g_heap->decay_tail);
+}
+
+/* -- check_segment -- */
+// Walks the blocks of the given mapping, from its first to its fence.
+static void check_segment(SegHead *seg, Found *found) {
+    size_t skip = seg->start == g_heap->start_addr ? HEAP_HEAD_SZ : 0;
+    BlockHead *block = (BlockHead*)(seg->start + skip + MAP_PAD_SZ);
+    BlockHead *fence = (BlockHead*)(seg->start + seg->size - SEG_TAIL_SZ);
+    int prev_used = 1;
+
+    while (block < fence) {
+        size_t sz = block_size(block);
+        if (sz < MIN_BLOCK_SZ || sz % ALIGN_SZ)
+            fail("block size", block);
+        if (!!(block->size & BLOCK_PREV_USED) != prev_used)
+            fail("BLOCK_PREV_USED doesn't match the block before", block);
+        if (block->size & BLOCK_MMAPPED)
+            fail("heap block flagged mmapped", block);
+
+        if (block->size & BLOCK_USED) {
+            found->walk_alloc_sz += sz;
+            found->walk_alloc_count++;
+        } else {
+            if (!prev_used)
+                fail("adjacent free blocks", block);
+            found->walk_free_sz += sz;
+            found->walk_free_count++;
+            if (!g_pool_sz && sz >= PURGE_MIN_SZ &&
+                !(block->size & BLOCK_ZEROED) && block_tag(block)->stamp)
+                found->walk_decay_count++;
+        }
+
+        prev_used = block->size & BLOCK_USED;
+        block = block_next(block);
+    }
+
+    if (block != fence || block_size(fence) || !(fence->size & BLOCK_USED))
+        fail("mapping's blocks don't end at its fence", block);
+}
+
+/* -- check_heap -- */
+// Checks the invariants of the held arena's heap, g_heap, if it has one.
+static void check_heap() {
+    if (!g_heap)
+        return;
+
+    Found found = { 0 };
+
+    for (size_t i = 0; i < BIN_COUNT; i++) {
+        int bit = (g_heap->binmap[i / BINMAP_BITS] >> (i % BINMAP_BITS)) & 1;
+        if (bit != (g_heap->bins[i] != NULL))
+            fail("bin bitmap", g_heap->bins[i]);
+        check_list(g_heap->bins[i], i, 1, &found);
+    }
+
+    for (size_t i = 0; i < TREE_COUNT; i++) {
+        int bit = (g_heap->treemap[i / BINMAP_BITS] >> (i % BINMAP_BITS)) & 1;
+        if (bit != (g_heap->trees[i] != NULL))
+            fail("tree bitmap", g_heap->trees[i]);
+        if (FIT_LISTS(g_fit))
+            check_list(g_heap->trees[i], i, 0, &found);
+        else
+            check_tree(g_heap->trees[i], i, NULL, NULL, &found);
+    }
+
+    check_decay(&found);
+
+    size_t maps = 0;
+    for (SegHead *seg = g_heap->segs; seg; seg = seg->next, maps++)
+        check_segment(seg, &found);
+
+    MemStats *stats = &g_heap->stats;
+    if (found.free_count != stats->free_count ||
+        found.free_sz != stats->free_sz)
+        fail("free stats don't match the lists and trees", g_heap);
+    if (found.walk_free_count != stats->free_count ||
+        found.walk_free_sz != stats->free_sz)
+        fail("free stats don't match the walk", g_heap);
+    if (found.walk_alloc_count != stats->alloc_count ||
+        found.walk_alloc_sz != stats->alloc_sz)
+        fail("alloc stats don't match the walk", g_heap);
+    if (found.walk_decay_count != found.decay_count)
+        fail("stamped blocks missing from the decay list", g_heap);
+    if (maps != stats->map_count)
+        fail("map count", g_heap);
+}
+
+/* -- check_arenas -- */
+// Checks every arena's heap, under its lock.
+static void check_arenas() {
+    for (size_t i = 0; i < g_arena_count; i++) {
+        arena_lock(g_arenas + i);
+        check_heap();
+        arena_unlock();
+    }
+}
+
+/* -- Workload -- */
+
+/* -- fill -- */
+// Fills the given block w/a byte derived from its size, which it records in
+// its first word.
+static void fill(void *ptr, size_t size) {
+    memset(ptr, (int)(size & 0xff), size);
+    if (size >= sizeof(size_t))
+        *(size_t*)ptr = size;
+}
+
+/* -- verify -- */
+// Checks that the given block, filled by fill, still holds its contents.
+static void verify(void *ptr) {
+    size_t size = *(size_t*)ptr;
+    unsigned char *bytes = ptr;
+
+    for (size_t i = sizeof(size_t); i < size; i += 61)
+        if (bytes[i] != (unsigned char)(size & 0xff))
+            fail("block contents lost", ptr);
+}
+
+/* -- worker -- */
+// Runs one thread's share of the workload. "arg" seeds its random choices.
+static void *worker(void *arg) {
+    uint64_t seed = (uint64_t)(uintptr_t)arg * 2654435761u + 1;
+
+    for (int i = 0; i < ops; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        // Mostly small blocks, now and then one past the mmap threshold
+        size_t size = (seed >> 20) % 100 ? (seed >> 8) % 3000 + sizeof(size_t)
+                                         : (seed >> 8) % (300 << 10) + 1024;
+        void *ptr;
+
+        switch ((seed >> 40) % 8) {
+            case 0:
+                ptr = calloc(1, size);
+                if (!ptr)
+                    fail("calloc failed", NULL);
+                for (size_t k = 0; k < size; k++)
+                    if (((unsigned char*)ptr)[k])
+                        fail("calloc'd block not zeroed", ptr);
+                break;
+
+            case 1: {
+                size_t align = (size_t)1 << ((seed >> 48) % 13 + 4);
+                ptr = memalign(align, size);
+                if (!ptr || (uintptr_t)ptr % align)
+                    fail("memalign failed or misaligned", ptr);
+                break;
+            }
+
+            default:
+                ptr = malloc(size);
+                if (!ptr)
+                    fail("malloc failed", NULL);
+                break;
+        }
+        fill(ptr, size);
+
+        // Now and then, resize the block, keeping what fits
+        if ((seed >> 30) % 6 == 0) {
+            size_t new_sz = (seed >> 50) % 2 ? size * 2 : size / 2 + 8;
+            ptr = realloc(ptr, new_sz);
+            if (!ptr)
+                fail("realloc failed", NULL);
+            unsigned char *bytes = ptr;
+            for (size_t k = sizeof(size_t); k < size && k < new_sz; k += 61)
+                if (bytes[k] != (unsigned char)(size & 0xff))
+                    fail("realloc lost contents", ptr);
+            fill(ptr, new_sz);
+        }
+
+        // Swap it into a shared slot, freeing whatever was there, likely
+        // another thread's block
+        void *old = __atomic_exchange_n(&slots[(seed >> 4) % SLOTS], ptr,
+                                        __ATOMIC_ACQ_REL);
+        if (old) {
+            verify(old);
+            free(old);
+        }
+    }
+
+    return NULL;
+}
+
+/* -- checker -- */
+// Checks every arena, over and over, while the workers run.
+static void *checker(void *arg) {
+    while (running)
+        check_arenas();
+    return NULL;
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    setvbuf(stdout, NULL, _IONBF, 0);   // Keep output from before an abort
+
+    int nthreads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2)
+        ops = atoi(argv[2]);
+    if (nthreads < 1 || nthreads > MAX_THREADS || ops < 1) {
+        printf("usage: %s [threads (1-%d)] [ops per thread]\n",
+               argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    pthread_t threads[MAX_THREADS], check_thread;
+    pthread_create(&check_thread, NULL, checker, NULL);
+    for (long i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void*)i);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    running = 0;
+    pthread_join(check_thread, NULL);
+
+    // The workers' caches were flushed as they exited. Free the blocks left
+    // in the table and flush our own cache, then check the arenas again.
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i]) {
+            verify(slots[i]);
+            free(slots[i]);
+        }
+    }
+    for (size_t cls = 0; cls < TCACHE_BINS; cls++)
+        tcache_flush(cls, t_cache.counts[cls]);
+
+    check_arenas();
+
+    printf("%zu arenas: ok\n", g_arena_count);
+    return 0;
+}
@@ -0,0 +1,295 @@
+// Fit policy benchmark of the memory management system. Replays allocation
+// traces recorded by tracerec.c, or w/no trace given, a synthetic server-like
+// mix of 1KB-64KB requests w/mixed lifetimes. Reports the replay's throughput,
+// and its peak resident size over its peak of live requested bytes. Run it
+// once per MEMORY_FIT policy to compare them.
+//
+// Build and run it against the wrapper like so (args: trace files, if any):
+//
+//      gcc -Wall -O2 -o benchfit benchfit.c
+//      for fit in best first next lifo tlsf; do
+//          MEMORY_FIT=$fit LD_PRELOAD=`pwd`/memory.so ./benchfit traces/*
+//      done
+//
+// Author: Dustin Fast
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define HASH_BITS 21            // Log2 of the num of live blocks tracked
+#define HASH_COUNT (1UL << HASH_BITS)
+#define SYNTH_OPS 1000000       // Num of calls in the synthetic mix
+#define SYNTH_LIVE 4096         // Num of blocks the synthetic mix keeps live
+#define RSS_EVERY 1024          // Num of calls between resident size samples
+
+// A recorded call, as written by tracerec.c
+typedef struct TraceRec {
+    unsigned long op;           // 0 malloc, 1 free, 2 calloc, 3 realloc
+    unsigned long size;         // Requested size, or calloc's num of elements
+    unsigned long elem_sz;      // calloc's element size, else 0
+    unsigned long ptr;          // ptr passed to free or realloc, else 0
+    unsigned long result;       // ptr returned, else 0
+} TraceRec;
+
+// Blocks live in the replay, keyed by the address they had when recorded.
+// An open-addressed hash table, static so it isn't served by the allocator
+// under test.
+static unsigned long keys[HASH_COUNT];
+static char *blocks[HASH_COUNT];
+static size_t sizes[HASH_COUNT];
+
+/* -- now -- */
+// Returns: The monotonic clock's time, in seconds.
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* -- rss_kb -- */
+// Returns: This process's resident size, in KB. Reads /proc w/o allocating.
+static long rss_kb() {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY);
+    ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    if (fd >= 0)
+        close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    long size = 0, pages = 0;
+    sscanf(buf, "%ld %ld", &size, &pages);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* -- hash_slot -- */
+// Returns: The slot holding "key", or the empty slot where it would go.
+static size_t hash_slot(unsigned long key) {
+    size_t i = (key * 0x9E3779B97F4A7C15UL) >> (64 - HASH_BITS);
+    while (keys[i] && keys[i] != key)
+        i = (i + 1) & (HASH_COUNT - 1);
+    return i;
+}
+
+/* -- hash_remove -- */
+// Empties slot i, shifting back any later entries its emptiness would hide.
+static void hash_remove(size_t i) {
+    size_t j = i;
+    keys[i] = 0;
+
+    for (;;) {
+        j = (j + 1) & (HASH_COUNT - 1);
+        if (!keys[j])
+            return;
+
+        // Move j into the hole at i unless j's home lies cyclically in (i, j]
+        size_t home = (keys[j] * 0x9E3779B97F4A7C15UL) >> (64 - HASH_BITS);
+        int stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+        if (stays)
+            continue;
+
+        keys[i] = keys[j];
+        blocks[i] = blocks[j];
+        sizes[i] = sizes[j];
+        keys[j] = 0;
+        i = j;
+    }
+}
+
+/* -- touch -- */
+// Writes to each page of the given block, as its caller would.
+static void touch(char *block, size_t size) {
+    for (size_t i = 0; i < size; i += 4096)
+        block[i] = 1;
+    if (size)
+        block[size - 1] = 1;
+}
+
+/* -- load_trace -- */
+// Reads the trace at "path".
+// Returns: The trace's records, w/their count in "count", or NULL on error.
+static TraceRec *load_trace(const char *path, long *count) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+
+    fseek(f, 0, SEEK_END);
+    *count = ftell(f) / sizeof(TraceRec);
+    rewind(f);
+
+    TraceRec *trace = malloc(*count * sizeof(TraceRec) + 1);
+    if (trace && fread(trace, sizeof(TraceRec), *count, f) != (size_t)*count) {
+        free(trace);
+        trace = NULL;
+    }
+    fclose(f);
+    return trace;
+}
+
+/* -- synth_trace -- */
+// Generates a server-like trace: 1KB-64KB requests, freed after a random
+// num of calls, w/SYNTH_LIVE blocks live in the steady state.
+// Returns: The trace's records, w/their count in "count".
+static TraceRec *synth_trace(long *count) {
+    TraceRec *trace = malloc(2 * SYNTH_OPS * sizeof(TraceRec));
+    unsigned long *live = calloc(SYNTH_LIVE, sizeof(unsigned long));
+    unsigned long next_id = 1;
+    uint32_t seed = 7;
+    long n = 0;
+
+    for (long i = 0; i < SYNTH_OPS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % SYNTH_LIVE;
+
+        // A third of the time, a freed slot is refilled right away
+        if (live[slot]) {
+            trace[n++] = (TraceRec){ 1, 0, 0, live[slot], 0 };
+            live[slot] = 0;
+            if ((seed >> 4) % 3)
+                continue;
+        }
+
+        // 1KB, plus up to a random power of two (1KB-64KB) more
+        seed = seed * 1103515245 + 12345;
+        size_t size = 1024 + (seed >> 6) % (1UL << (10 + (seed >> 28) % 7));
+        live[slot] = (next_id++) << 4;  // Fake, 16-byte aligned address
+        trace[n++] = (TraceRec){ 0, size, 0, 0, live[slot] };
+    }
+
+    free(live);
+    *count = n;
+    return trace;
+}
+
+/* -- replay -- */
+// Replays the given trace, then frees whatever it left live, and reports
+//      the results under "name".
+static void replay(const char *name, TraceRec *trace, long count) {
+    long base_rss = rss_kb(), peak_rss = base_rss;
+    size_t live = 0, peak_live = 0;
+    double secs = 0;
+    long calls = 0;
+
+    for (long i = 0; i < count; i++) {
+        TraceRec *rec = &trace[i];
+        double start, end;
+        size_t slot;
+        char *block;
+
+        switch (rec->op) {
+            case 0:     // malloc
+            case 2:     // calloc
+                start = now();
+                block = rec->op ? calloc(rec->size, rec->elem_sz)
+                                : malloc(rec->size);
+                end = now();
+                slot = hash_slot(rec->result);
+                if (!rec->result || !block || keys[slot]) {
+                    free(block);    // Failed, or its address wasn't freed
+                    break;
+                }
+                keys[slot] = rec->result;
+                blocks[slot] = block;
+                sizes[slot] = rec->op ? rec->size * rec->elem_sz : rec->size;
+                live += sizes[slot];
+                touch(block, sizes[slot]);
+                break;
+
+            case 1:     // free
+                slot = hash_slot(rec->ptr);
+                if (!rec->ptr || !keys[slot])
+                    continue;       // Freed a block from before the trace
+                start = now();
+                free(blocks[slot]);
+                end = now();
+                live -= sizes[slot];
+                hash_remove(slot);
+                break;
+
+            case 3:     // realloc
+                block = NULL;
+                if (rec->ptr) {
+                    slot = hash_slot(rec->ptr);
+                    if (!keys[slot])
+                        continue;   // Resized a block from before the trace
+                    block = blocks[slot];
+                    live -= sizes[slot];
+                    hash_remove(slot);
+                }
+                start = now();
+                block = realloc(block, rec->size);
+                end = now();
+                if (!rec->result || !block)
+                    break;
+                slot = hash_slot(rec->result);
+                keys[slot] = rec->result;
+                blocks[slot] = block;
+                sizes[slot] = rec->size;
+                live += rec->size;
+                touch(block, rec->size);
+                break;
+
+            default:
+                continue;
+        }
+
+        secs += end - start;
+        calls++;
+        if (live > peak_live)
+            peak_live = live;
+        if (calls % RSS_EVERY == 0) {
+            long rss = rss_kb();
+            if (rss > peak_rss)
+                peak_rss = rss;
+        }
+    }
+
+    for (size_t i = 0; i < HASH_COUNT; i++) {
+        if (keys[i]) {
+            free(blocks[i]);
+            keys[i] = 0;
+        }
+    }
+
+    printf("%-24s %6.1f Mops/s  rss %8ldKB  live %8zuKB  rss/live %.2f\n",
+           name, calls / secs / 1e6, peak_rss - base_rss, peak_live >> 10,
+           (double)(peak_rss - base_rss) / ((peak_live >> 10) + 1));
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    char *fit = getenv("MEMORY_FIT");
+    printf("MEMORY_FIT=%s\n", fit ? fit : "(default)");
+
+    // Fault in the hash table up front, so its pages aren't counted
+    memset(keys, 0, sizeof(keys));
+    memset(blocks, 0, sizeof(blocks));
+    memset(sizes, 0, sizeof(sizes));
+
+    long count;
+    TraceRec *trace;
+
+    if (argc < 2) {
+        trace = synth_trace(&count);
+        replay("1K-64K server mix", trace, count);
+        free(trace);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        trace = load_trace(argv[i], &count);
+        if (!trace) {
+            printf("can't read %s\n", argv[i]);
+            return 1;
+        }
+        replay(argv[i], trace, count);
+        free(trace);
+    }
+    return 0;
+}
@@ -0,0 +1,270 @@
+// Free block lookup benchmark of the memory management system. Fragments
+// the heap into a given num of free blocks, each fenced off from the next by
+// an allocated one so they can't merge, then times mallocs of sizes none of
+// those free blocks can serve, each followed by an untimed free. A first-fit
+// walk of one free list must step past every one of them, so it slows in
+// step w/their num, while lookups in the size-class bins go straight to a
+// class that fits.
+//
+// For comparison, each run is repeated against a first-fit baseline: a heap
+// of one address-ordered free list, walked from its head for the first block
+// that fits, as block_findfree did before the size classes. It runs in a
+// region of its own, so both columns come from the same program, side by
+// side. Runs w/more free blocks make fewer mallocs, to keep the baseline's
+// runs short.
+//
+// Free blocks are 1040B-2000B and requests 2048B-4000B, too big for the
+// thread cache, so every one is served by a heap lookup.
+//
+// Build and run it against the wrapper like so (args: the nums of free
+// blocks to try):
+//
+//      gcc -Wall -O2 -o benchfree benchfree.c
+//      LD_PRELOAD=`pwd`/memory.so ./benchfree 1000 10000 100000
+//
+// Author: Dustin Fast
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#define FREE_MIN_SZ 1040        // Min size of a free block
+#define FREE_MAX_SZ 2000        // Max size of a free block
+#define MIN_SZ 2048             // Min size of a timed request
+#define MAX_SZ 4000             // Max size of a timed request
+#define MAX_PAIRS 100000        // Max num of malloc/free pairs per run
+#define WALK_STEPS 100000000    // Num of free blocks a run may walk past
+#define RING 16                 // Num of timed blocks kept live at once
+
+#define WALK_USED 1             // Size flag of a baseline block in use
+#define WALK_PREV_USED 2        // Size flag of a baseline block after one in use
+#define WALK_FLAGS 15           // Mask of a baseline block's size flags
+#define WALK_MIN_SZ 32          // Min size of a baseline block, w/its header
+
+// A baseline block's header. Sizes include the header and are multiples of
+// 16, leaving the low bits for flags. Each free block's size is mirrored in a
+// footer at its end, so free can merge it w/the next block freed in O(1).
+typedef struct WalkBlock {
+    size_t size;
+    struct WalkBlock *next;     // Free blocks only
+    struct WalkBlock *prev;     // Free blocks only
+} WalkBlock;
+
+typedef void *(*AllocFn)(size_t);
+typedef void (*FreeFn)(void*);
+
+static uint32_t seed = 12345;
+static WalkBlock *walk_head;    // Baseline's free list
+
+/* -- now -- */
+// Returns: The monotonic clock's time, in seconds.
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* -- rnd_size -- */
+// Returns: A random request size, between "min" and "max".
+static size_t rnd_size(size_t min, size_t max) {
+    seed = seed * 1103515245 + 12345;
+    return min + (seed >> 8) % (max - min + 1);
+}
+
+/* -- walk_mark -- */
+// Makes the given block of the given size free, w/its footer, and clears the
+//      next block's WALK_PREV_USED flag. A free block's prev is always in use.
+static void walk_mark(WalkBlock *block, size_t size) {
+    block->size = size | WALK_PREV_USED;
+    *(size_t*)((char*)block + size - sizeof(size_t)) = size;
+    ((WalkBlock*)((char*)block + size))->size &= ~(size_t)WALK_PREV_USED;
+}
+
+/* -- walk_link -- */
+// Links the given free block into the baseline's list, after "prev" (or at
+//      the head, if NULL).
+static void walk_link(WalkBlock *block, WalkBlock *prev) {
+    block->prev = prev;
+    block->next = prev ? prev->next : walk_head;
+    if (block->next)
+        block->next->prev = block;
+    if (prev)
+        prev->next = block;
+    else
+        walk_head = block;
+}
+
+/* -- walk_unlink -- */
+// Removes the given free block from the baseline's list.
+static void walk_unlink(WalkBlock *block) {
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        walk_head = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+}
+
+/* -- walk_init -- */
+// Makes the baseline's heap one free block spanning most of the "size" bytes
+//      at "region", followed by a used header so free never merges past it.
+static void walk_init(char *region, size_t size) {
+    size_t block_sz = (size - 32) & ~(size_t)15;
+    ((WalkBlock*)(region + 16 + block_sz))->size = WALK_USED;
+    walk_head = NULL;
+    walk_mark((WalkBlock*)(region + 16), block_sz);
+    walk_link((WalkBlock*)(region + 16), NULL);
+}
+
+/* -- walk_malloc -- */
+// Returns: A ptr to "size" bytes from the first block on the baseline's list
+//      that fits, or NULL if none does. What's left of the block, if big
+//      enough, stays free in the block's place on the list.
+static void *walk_malloc(size_t size) {
+    size_t need = (size + sizeof(size_t) + 15) & ~(size_t)15;
+    if (need < WALK_MIN_SZ)
+        need = WALK_MIN_SZ;
+
+    for (WalkBlock *block = walk_head; block; block = block->next) {
+        size_t block_sz = block->size & ~(size_t)WALK_FLAGS;
+        if (block_sz < need)
+            continue;
+
+        if (block_sz - need >= WALK_MIN_SZ) {
+            WalkBlock *tail = (WalkBlock*)((char*)block + need);
+            walk_mark(tail, block_sz - need);
+            walk_link(tail, block->prev);
+            walk_unlink(block);
+        } else {
+            need = block_sz;
+            walk_unlink(block);
+            ((WalkBlock*)((char*)block + need))->size |= WALK_PREV_USED;
+        }
+
+        block->size = need | WALK_USED | WALK_PREV_USED;
+        return (char*)block + sizeof(size_t);
+    }
+    return NULL;
+}
+
+/* -- walk_free -- */
+// Frees the given baseline block, merging it w/its free neighbors. If it has
+//      none, it's inserted in address order, walking the list from its head.
+static void walk_free(void *ptr) {
+    if (!ptr)
+        return;
+
+    WalkBlock *block = (WalkBlock*)((char*)ptr - sizeof(size_t));
+    size_t size = block->size & ~(size_t)WALK_FLAGS;
+    WalkBlock *next = (WalkBlock*)((char*)block + size);
+    WalkBlock *prev = NULL;     // Where on the list the freed block goes
+
+    if (!(block->size & WALK_PREV_USED)) {
+        // Grow the free block before it, which keeps its place
+        block = (WalkBlock*)((char*)block - *(size_t*)((char*)block - 8));
+        size += block->size & ~(size_t)WALK_FLAGS;
+        prev = block->prev;
+        walk_unlink(block);
+    } else if (!(next->size & WALK_USED)) {
+        prev = next->prev;      // Take the next block's place
+    } else {
+        for (WalkBlock *curr = walk_head; curr && curr < block;
+             curr = curr->next)
+            prev = curr;
+    }
+
+    if (!(next->size & WALK_USED)) {
+        size += next->size & ~(size_t)WALK_FLAGS;
+        walk_unlink(next);
+    }
+
+    walk_mark(block, size);
+    walk_link(block, prev);
+}
+
+/* -- run -- */
+// Returns: The mean ns per malloc of "pairs" malloc/free pairs, made w/the
+//      given functions against a heap holding "nfree" free blocks.
+static double run(long nfree, long pairs, AllocFn alloc_fn, FreeFn free_fn) {
+    char **blocks = malloc(2 * nfree * sizeof(char*));
+    seed = 12345;
+
+    // Allocate twice as many blocks as we want free, then free every other
+    // one. The ones left allocated keep the free ones apart. They're freed
+    // from the top down, so the baseline inserts each at its list's head.
+    for (long i = 0; i < 2 * nfree; i++) {
+        blocks[i] = alloc_fn(rnd_size(FREE_MIN_SZ, FREE_MAX_SZ));
+        if (!blocks[i]) {
+            printf("malloc failed\n");
+            exit(1);
+        }
+    }
+    for (long i = 2 * nfree - 2; i >= 0; i -= 2)
+        free_fn(blocks[i]);
+
+    // Keep the last few timed blocks live, so each malloc must find a block
+    // rather than reusing the one just freed.
+    char *ring[RING] = { 0 };
+    double secs = 0;
+    for (long i = 0; i < pairs; i++) {
+        free_fn(ring[i % RING]);
+        size_t size = rnd_size(MIN_SZ, MAX_SZ);
+        double start = now();
+        ring[i % RING] = alloc_fn(size);
+        secs += now() - start;
+        if (!ring[i % RING]) {
+            printf("malloc failed\n");
+            exit(1);
+        }
+        ring[i % RING][0] = (char)i;
+    }
+
+    for (int i = 0; i < RING; i++)
+        free_fn(ring[i]);
+    for (long i = 1; i < 2 * nfree; i += 2)
+        free_fn(blocks[i]);
+    free(blocks);
+
+    return secs / pairs * 1e9;
+}
+
+/* -- compare -- */
+// Prints the mean ns per malloc against "nfree" free blocks, of malloc and
+//      of the first-fit baseline.
+static void compare(long nfree) {
+    long pairs = WALK_STEPS / nfree + 1;
+    if (pairs > MAX_PAIRS)
+        pairs = MAX_PAIRS;
+    double ns = run(nfree, pairs, malloc, free);
+
+    // The baseline's region holds the fenced blocks and the timed ones
+    size_t region_sz = 2 * nfree * (FREE_MAX_SZ + 32) + RING * (MAX_SZ + 32)
+                       + 4096;
+    char *region = malloc(region_sz);
+    if (!region) {
+        printf("malloc(%zu) failed\n", region_sz);
+        exit(1);
+    }
+    walk_init(region, region_sz);
+    double walk_ns = run(nfree, pairs, walk_malloc, walk_free);
+    free(region);
+
+    printf("%11ld %12.1f %15.1f\n", nfree, ns, walk_ns);
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    printf("free blocks  malloc (ns)  first-fit (ns)\n");
+
+    if (argc < 2) {
+        compare(1000);
+        compare(10000);
+        compare(100000);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++)
+        compare(atol(argv[i]));
+    return 0;
+}
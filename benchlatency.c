@@ -0,0 +1,109 @@
+// Latency benchmark of the memory management system. Keeps 4096 objects of
+// 16B-512KB live, and repeatedly frees a random one and allocates another in
+// its place, timing every call. Reports the median, 99.99th percentile and
+// max latency of malloc and of free, and the minor page faults taken.
+//
+// Build and run it against the wrapper like so, w/ and w/o a real-time pool
+// (arg: num of free/malloc pairs):
+//
+//      gcc -Wall -O2 -o benchlatency benchlatency.c
+//      LD_PRELOAD=`pwd`/memory.so ./benchlatency 2000000
+//      MEMORY_POOL_SZ=512M LD_PRELOAD=`pwd`/memory.so ./benchlatency 2000000
+//
+// Author: Dustin Fast
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#define LIVE 4096               // Num of objects kept live
+
+/* -- now_ns -- */
+// Returns: The monotonic clock's time, in nanoseconds.
+static double now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+/* -- minor_faults -- */
+// Returns: The num of minor page faults this process has taken so far.
+static long minor_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+/* -- cmp_float -- */
+// Orders floats ascending, for qsort.
+static int cmp_float(const void *a, const void *b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* -- report -- */
+// Sorts the given "n" latencies and prints their median, 99.99th percentile
+//      and max.
+static void report(const char *name, float *lat, long n) {
+    qsort(lat, n, sizeof(float), cmp_float);
+    printf("%-6s p50 %6.0fns  p99.99 %8.0fns  max %9.0fns\n",
+           name, lat[n / 2], lat[(long)(n * 0.9999)], lat[n - 1]);
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    long pairs = argc > 1 ? atol(argv[1]) : 2000000;
+    if (pairs < 1) {
+        printf("usage: %s [pairs]\n", argv[0]);
+        return 1;
+    }
+
+    // Latency buffers come first, so their own faults aren't counted
+    float *malloc_lat = calloc(pairs, sizeof(float));
+    float *free_lat = calloc(pairs, sizeof(float));
+    char **live = calloc(LIVE, sizeof(char*));
+    if (!malloc_lat || !free_lat || !live) {
+        printf("out of memory\n");
+        return 1;
+    }
+    for (long i = 0; i < pairs; i++)
+        malloc_lat[i] = free_lat[i] = 1;
+
+    long faults = minor_faults();
+    uint32_t seed = 12345;
+
+    for (long i = 0; i < pairs; i++) {
+        // Sizes are spread evenly over their powers of two, 16B to 512KB
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % LIVE;
+        size_t size = 16 + (seed >> 3) % ((size_t)1 << ((seed >> 20) % 16 + 4));
+
+        double t0 = now_ns();
+        free(live[slot]);
+        double t1 = now_ns();
+        live[slot] = malloc(size);
+        double t2 = now_ns();
+
+        if (!live[slot]) {
+            printf("malloc(%zu) failed after %ld pairs\n", size, i);
+            return 1;
+        }
+        live[slot][0] = 1;  // Touch the object, as a caller would
+
+        free_lat[i] = t1 - t0;
+        malloc_lat[i] = t2 - t1;
+    }
+
+    printf("%ld pairs, %ld minor faults\n", pairs, minor_faults() - faults);
+    report("malloc", malloc_lat, pairs);
+    report("free", free_lat, pairs);
+
+    for (int i = 0; i < LIVE; i++)
+        free(live[i]);
+    free(live);
+    free(malloc_lat);
+    free(free_lat);
+    return 0;
+}
@@ -0,0 +1,145 @@
+// Fill and copy benchmark of the memory management system's mem_set and
+// mem_cpy. Times a plain byte loop and each variant this CPU supports, over
+// buffer sizes from 64B to 64MB, then times a 64MB copy+fill loop w/ and w/o
+// non-temporal stores. The variants are static, so this application includes
+// implementation.c itself, and links w/memory.c, rather than running against
+// the wrapper.
+//
+// Build and run it like so:
+//
+//      gcc -Wall -O2 -o benchmem benchmem.c memory.c -lpthread
+//      ./benchmem
+//
+// Author: Dustin Fast
+
+#include "implementation.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define TOTAL_SZ (1024 * 1048576)   // Num of bytes each timing moves
+#define LOOP_SZ (64 * 1048576)      // Buffer size of the copy+fill loop
+#define LOOP_REPS 16                // Num of passes of the copy+fill loop
+
+typedef void *(*SetFn)(void*, int, size_t);
+typedef void *(*CpyFn)(void*, const void*, size_t);
+
+/* -- now -- */
+// Returns: The monotonic clock's time, in seconds.
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* -- set_byte -- */
+// Fills the first n bytes at s with c, one byte at a time, as mem_set did
+//      before it was vectorized. Kept from being turned into a memset call.
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void *set_byte(void *s, int c, size_t n) {
+    char *p = s;
+    while (n--)
+        *p++ = (char)c;
+    return s;
+}
+
+/* -- cpy_byte -- */
+// Copies n bytes from src to dest, one byte at a time, as mem_cpy did before
+//      it was vectorized. Kept from being turned into a memcpy call.
+__attribute__((optimize("no-tree-loop-distribute-patterns")))
+static void *cpy_byte(void *dest, const void *src, size_t n) {
+    char *pd = dest;
+    const char *ps = src;
+    while (n--)
+        *pd++ = *ps++;
+    return dest;
+}
+
+/* -- rate -- */
+// Returns: The GB/s of filling (if "cpy" is NULL) or copying "size" bytes
+//      over and over, until TOTAL_SZ bytes are moved.
+static double rate(SetFn set, CpyFn cpy, char *dest, char *src, size_t size) {
+    size_t reps = TOTAL_SZ / size + 1;
+    double start = now();
+
+    for (size_t i = 0; i < reps; i++) {
+        if (cpy)
+            cpy(dest, src, size);
+        else
+            set(dest, (int)i, size);
+        __asm__ volatile("" : : "r"(dest) : "memory");  // Keep every pass
+    }
+
+    return (double)reps * size / (now() - start) / 1e9;
+}
+
+/* -- report -- */
+// Prints the fill and copy rates of the given variant at each buffer size.
+static void report(const char *name, SetFn set, CpyFn cpy,
+                   char *dest, char *src) {
+    static const size_t sizes[] = { 64, 4096, 262144, 4194304, LOOP_SZ };
+
+    printf("%-6s", name);
+    for (int i = 0; i < 5; i++)
+        printf(" %7.1f", rate(set, NULL, dest, src, sizes[i]));
+    printf("  |");
+    for (int i = 0; i < 5; i++)
+        printf(" %7.1f", rate(NULL, cpy, dest, src, sizes[i]));
+    printf("\n");
+}
+
+/* -- copy_fill_loop -- */
+// Returns: The secs taken by LOOP_REPS passes of copying src to dest and
+//      refilling src, w/the selected mem_cpy and mem_set variants.
+static double copy_fill_loop(char *dest, char *src) {
+    double start = now();
+
+    for (int i = 0; i < LOOP_REPS; i++) {
+        mem_cpy(dest, src, LOOP_SZ);
+        mem_set(src, i, LOOP_SZ);
+    }
+
+    return now() - start;
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    char *dest = aligned_alloc(64, LOOP_SZ);
+    char *src = aligned_alloc(64, LOOP_SZ);
+    if (!dest || !src) {
+        printf("out of memory\n");
+        return 1;
+    }
+    memset(dest, 1, LOOP_SZ);
+    memset(src, 2, LOOP_SZ);
+
+    printf("GB/s   fill: 64B     4KB   256KB     4MB    64MB  |"
+           " copy: 64B     4KB   256KB     4MB    64MB\n");
+    report("byte", set_byte, cpy_byte, dest, src);
+    report("word", mem_set_word, mem_cpy_word, dest, src);
+#if defined(__x86_64__)
+    report("sse2", mem_set_sse2, mem_cpy_sse2, dest, src);
+    if (mem_has_avx2())
+        report("avx2", mem_set_avx2, mem_cpy_avx2, dest, src);
+#endif
+
+    // The copy+fill loop, w/non-temporal stores forced on, then off. Which
+    // one mem_init picks for it depends on this CPU's last-level cache size.
+    size_t nt_sz = g_mem_nt_sz;
+    g_mem_nt_sz = 0;
+    double nt_secs = copy_fill_loop(dest, src);
+    g_mem_nt_sz = SIZE_MAX;
+    double secs = copy_fill_loop(dest, src);
+    g_mem_nt_sz = nt_sz;
+
+    printf("%dMB copy+fill x%d: %.2fs w/non-temporal stores, %.2fs w/o "
+           "(used past %zuKB)\n", LOOP_SZ >> 20, LOOP_REPS, nt_secs, secs,
+           nt_sz >> 10);
+
+    free(dest);
+    free(src);
+    return 0;
+}
@@ -0,0 +1,110 @@
+// Realloc benchmark of the memory management system. Grows a buffer from
+// 1MB to a given size by doubling it w/realloc, filling each new half and
+// checking that the old contents survived every move. Blocks past the mmap
+// threshold have mappings of their own, so each resize is an mremap rather
+// than a copy.
+//
+// Only the realloc call itself is timed. For comparison, the same growth is
+// then done by hand, w/malloc, memcpy and free, as a resize that copies would
+// do it. Prints the time of each step of both, one line per size.
+//
+// Build and run it against the wrapper like so (arg: the final size in MB):
+//
+//      gcc -Wall -O2 -o benchrealloc benchrealloc.c
+//      LD_PRELOAD=`pwd`/memory.so ./benchrealloc 1024
+//
+// Author: Dustin Fast
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define START_SZ (1024 * 1024)  // Size of the buffer before the first realloc
+#define MAX_STEPS 48            // Max num of doublings
+
+/* -- now -- */
+// Returns: The monotonic clock's time, in seconds.
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* -- check -- */
+// Returns: 1 if each of the first "size" bytes of "buf" holds the fill byte,
+//      else 0. Checks one byte per page, plus the last.
+static int check(const char *buf, size_t size) {
+    for (size_t i = 0; i < size; i += 4096)
+        if (buf[i] != 7)
+            return 0;
+    return buf[size - 1] == 7;
+}
+
+/* -- copy_realloc -- */
+// Returns: A ptr to a new block of "size" bytes holding the first "old_sz"
+//      bytes of "ptr", which is freed, or NULL on failure.
+static char *copy_realloc(char *ptr, size_t old_sz, size_t size) {
+    char *result = malloc(size);
+    if (result) {
+        memcpy(result, ptr, old_sz);
+        free(ptr);
+    }
+    return result;
+}
+
+/* -- grow -- */
+// Grows a buffer from START_SZ to "final_sz", w/realloc if "copy" is 0, else
+//      w/copy_realloc. Stores the secs each step took in "secs".
+// Returns: The num of steps, or -1 on failure.
+static int grow(size_t final_sz, int copy, double *secs) {
+    size_t size = START_SZ;
+    int steps = 0;
+
+    char *buf = malloc(size);
+    if (!buf) {
+        printf("malloc(%zu) failed\n", size);
+        return -1;
+    }
+    memset(buf, 7, size);
+
+    while (size < final_sz && steps < MAX_STEPS) {
+        double start = now();
+        char *new_buf = copy ? copy_realloc(buf, size, size * 2)
+                             : realloc(buf, size * 2);
+        secs[steps] = now() - start;
+
+        if (!new_buf) {
+            printf("realloc(%zu) failed\n", size * 2);
+            free(buf);
+            return -1;
+        }
+        buf = new_buf;
+        if (!check(buf, size)) {
+            printf("contents lost growing to %zu\n", size * 2);
+            return -1;
+        }
+        memset(buf + size, 7, size);
+        size *= 2;
+        steps++;
+    }
+
+    free(buf);
+    return steps;
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    size_t final_sz = (argc > 1 ? atol(argv[1]) : 1024) * 1024 * 1024;
+    double realloc_secs[MAX_STEPS], copy_secs[MAX_STEPS];
+
+    int steps = grow(final_sz, 0, realloc_secs);
+    if (steps < 0 || grow(final_sz, 1, copy_secs) != steps)
+        return 1;
+
+    printf("    size  realloc (ms)  malloc+memcpy+free (ms)\n");
+    for (int i = 0; i < steps; i++)
+        printf("%6zuMB %13.3f %24.3f\n", ((size_t)START_SZ << (i + 1)) >> 20,
+               realloc_secs[i] * 1e3, copy_secs[i] * 1e3);
+    return 0;
+}
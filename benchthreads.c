@@ -0,0 +1,103 @@
+// Multi-threaded malloc/free benchmark of the memory management system.
+// Each thread keeps a window of live small blocks (16B-1KB), and repeatedly
+// frees a random one and allocates another in its place, so most requests
+// are served from the thread cache. Runs w/1, 2, 4 ... threads, up to a given
+// max, and reports the total throughput at each count, so how well it scales
+// can be read off in one run.
+//
+// Build and run it against the wrapper like so (args: max num of threads, and
+// num of free/malloc pairs per thread):
+//
+//      gcc -Wall -O2 -o benchthreads benchthreads.c -lpthread
+//      LD_PRELOAD=`pwd`/memory.so ./benchthreads 8 2000000
+//
+// Running it without LD_PRELOAD gives the c stdlib's numbers for comparison.
+//
+// Author: Dustin Fast
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LIVE 1024               // Num of blocks each thread keeps live
+#define MAX_SZ 1024             // Max size of a request
+
+static long iters = 2000000;    // Num of free/malloc pairs per thread
+
+/* -- now -- */
+// Returns: The monotonic clock's time, in seconds.
+static double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* -- worker -- */
+// Runs one thread's share of the benchmark. "arg" seeds its random sizes.
+static void *worker(void *arg) {
+    uint32_t seed = (uint32_t)(uintptr_t)arg * 2654435761u + 1;
+    char **live = calloc(LIVE, sizeof(char*));
+
+    for (long i = 0; i < iters; i++) {
+        seed = seed * 1103515245 + 12345;
+        int slot = (seed >> 8) % LIVE;
+        size_t size = 16 + (seed >> 16) % (MAX_SZ - 15);
+
+        free(live[slot]);
+        live[slot] = malloc(size);
+        if (!live[slot]) {
+            printf("malloc(%zu) failed\n", size);
+            exit(1);
+        }
+        live[slot][0] = (char)i;   // Touch the block, as a caller would
+    }
+
+    for (int i = 0; i < LIVE; i++)
+        free(live[i]);
+    free(live);
+    return NULL;
+}
+
+/* -- run -- */
+// Returns: The Mops/s of "nthreads" threads running the benchmark at once.
+static double run(int nthreads, pthread_t *threads) {
+    double start = now();
+
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)i);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    return 2.0 * nthreads * iters / (now() - start) / 1e6;
+}
+
+/* --- main --- */
+int main(int argc, char **argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    if (argc > 2)
+        iters = atol(argv[2]);
+    if (max_threads < 1 || iters < 1) {
+        printf("usage: %s [max threads] [pairs per thread]\n", argv[0]);
+        return 1;
+    }
+
+    pthread_t *threads = malloc(max_threads * sizeof(pthread_t));
+    double base = 0;
+
+    // Double the count each run, ending on max_threads even if it's not a
+    // power of two.
+    for (int n = 1; ; n = n * 2 < max_threads ? n * 2 : max_threads) {
+        double mops = run(n, threads);
+        if (n == 1)
+            base = mops;
+        printf("%3d threads: %7.1f Mops/s  (%.2fx 1 thread)\n",
+               n, mops, mops / base);
+        if (n == max_threads)
+            break;
+    }
+
+    free(threads);
+    return 0;
+}
@@ -51,8 +51,21 @@
     
 */
 
+#define _GNU_SOURCE                         // For mremap
+
 #include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/mman.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#include "memory.h"
 
 
 /* Predefined helper functions */
@@ -64,66 +77,648 @@
 /* Your helper functions */
 /* Begin Definitions ----------------------------------------------------DF */
 
-// Memory Block Header. Also serves double duty as a linked list node
+// Memory Block Header. Also serves double duty as a linked list node. Only
+// "size" is a true header; the list links occupy the first bytes of the data
+// field, so they exist only while the block is free.
 typedef struct BlockHead {
-  size_t size;              // Size of the block, with header, in bytes
-  char *data_addr;          // Ptr to the block's data field
-  struct BlockHead *next;   // Next block (unused if block not in free list)
-  struct BlockHead *prev;   // Prev block (unused if block not in free list)
-} BlockHead;                // Data field immediately follows above 4 bytes
+  size_t size;              // Size of the block, with header, in bytes, and
+                            //      the BLOCK_* flags in its low bits
+  union {
+    struct BlockHead *next; // Next block (free blocks only - overlaps data)
+    struct BlockHead *left; // Or, in the tree, root of its left subtree
+  };
+  union {
+    struct BlockHead *prev; // Prev block (free blocks only - overlaps data)
+    struct BlockHead *right;  // Or, in the tree, root of its right subtree
+  };
+} BlockHead;                // Data field immediately follows "size"
+
+// Boundary tag flags. Block sizes are kept a multiple of ALIGN_SZ, leaving the
+// low bits of BlockHead.size free for these. A free block also repeats its
+// size in its last word (its "footer"), so the block after it can find it.
+#define BLOCK_USED 0x1                      // Block is allocated
+#define BLOCK_PREV_USED 0x2                 // Block just before is allocated
+#define BLOCK_MMAPPED 0x4                   // Block has a mapping to itself
+#define BLOCK_ZEROED 0x8                    // Free block's contents are zero
+#define BLOCK_FLAGS (BLOCK_USED | BLOCK_PREV_USED | BLOCK_MMAPPED | BLOCK_ZEROED)
+
+// A BLOCK_ZEROED block is zero throughout, except for its header, its list
+// links and its footer. Fresh mappings start out that way, and splitting one
+// keeps it so. A dirty block merging w/a zeroed one of at most ZERO_SCRUB_MAX
+// bytes is zeroed too, rather than the merged block losing the flag.
+#define ZERO_SCRUB_MAX 4096
+
+// Free blocks smaller than TREE_MIN_SZ are kept in lists by exact size. Those
+// larger are kept in trees, one per size class of TREE_SUB_BITS classes per
+// power of two, each ordered by size, then address. The trees are treaps, w/
+// priorities hashed from the blocks' addresses, so the best fit for a request
+// is found in O(log n). Their nodes' children are kept in the list links, and
+// they're walked w/o parent ptrs, so they cost no room the lists don't.
+#define BIN_COUNT 64                        // Num of exact size classes
+#define BIN_STEP 16                         // Byte spacing of those classes
+#define TREE_COUNT 64                       // Num of tree size classes
+#define TREE_SHIFT 10                       // log2(1st tree class's min sz)
+#define TREE_SUB_BITS 2                     // log2(tree classes per pow of 2)
+#define TREE_MIN_SZ (BIN_COUNT * BIN_STEP)  // Min sz of the trees' blocks
+#define BINMAP_BITS (8 * sizeof(size_t))    // Classes per bitmap word
+#define BINMAP_WORDS (BIN_COUNT / BINMAP_BITS)  // Words in the class bitmap
+#define TREEMAP_WORDS (TREE_COUNT / BINMAP_BITS)  // Words in the tree bitmap
+
+// Placement policies, for free blocks of TREE_MIN_SZ and up, picked by the
+// MEMORY_FIT env var at heap_init. (Smaller ones are kept by exact size, so
+// any block of the request's own class fits as well as any other, and every
+// policy takes the one most recently freed.) Each still searches the request's
+// own size class, then the next non-empty class above it, every block of
+// which fits - they differ in which block of the class they take:
+//      best  - The smallest that fits, lowest address first. The default.
+//      first - The lowest-addressed that fits.
+//      next  - The lowest-addressed that fits at or past the last one taken,
+//              wrapping around to the class's first.
+//      lifo  - The one most recently freed that fits.
+//      tlsf  - The one most recently freed, if it fits. Takes O(1), as only
+//              one block per class is ever looked at. The default for a pool.
+// best, first and next keep each class in a treap, the first two ordered by
+// address. lifo and tlsf keep each in a list, w/the latest free at its head.
+// first, next and lifo take time linear in the class's blocks in the worst
+// case, as fitting blocks may be anywhere in them.
+#define FIT_BEST 0
+#define FIT_FIRST 1
+#define FIT_NEXT 2
+#define FIT_LIFO 3
+#define FIT_TLSF 4
+#define FIT_LISTS(fit) ((fit) >= FIT_LIFO)  // Policy keeps its classes in lists
+
+// Mapping (segment) header. Each mapping that makes up the heap ends w/one,
+// just past the fence tag that ends its blocks, so the block before the fence
+// can find it. Together they form the heap's registry of mappings.
+typedef struct SegHead {
+    char *start;            // Ptr to first byte of the mapping
+    size_t size;            // Size of the mapping in bytes
+    struct SegHead *next;   // Next mapping in the registry
+    struct SegHead *prev;   // Prev mapping in the registry
+} SegHead;
 
 // The heap header.
 typedef struct HeapHead {
-    size_t size;            // Total sz of heap+blocks+headers, in bytes
+    MemStats stats;         // Live sizes and counts of mappings and blocks
     char *start_addr;       // Ptr to first byte of heap
-    BlockHead *first_free;  // Ptr to head of the "free" memory list 
-} HeapHead;                 // Memory blocks follows the above 3 bytes
-
-// Global heap ptr
-HeapHead *g_heap = NULL;
+    SegHead *segs;          // Registry of the heap's mappings, this one too
+    char *commit_end;       // End of the usable part of this mapping
+    char *reserve_end;      // End of the addresses reserved for it to grow
+                            //      into, or NULL if there are none
+    BlockHead *bins[BIN_COUNT];     // Heads of the free lists by size class
+    size_t binmap[BINMAP_WORDS];    // Bit i is set iff bins[i] is non-empty
+    BlockHead *trees[TREE_COUNT];   // Roots of the trees by size class, or
+                                    //      list heads, per the fit policy
+    size_t treemap[TREEMAP_WORDS];  // Bit i is set iff trees[i] is non-empty
+    char *rover;            // Next fit's search start, the last block taken
+    size_t idle_since;      // When alloc_count last fell to 0, in ms
+    size_t purge_due;       // When the next stamped free block decays, in
+                            //      ms, or 0 if none are stamped
+    BlockHead *decay_head;  // Stamped free blocks, oldest stamp first
+    BlockHead *decay_tail;  // Newest stamp
+    size_t grow_sz;         // Min sz of the next expansion
+    size_t grown_at;        // When the heap last expanded, in ms
+    size_t ahead_sz;        // Free bytes to keep ahead of demand
+    size_t ahead_base;      // alloc_sz as of the last background tick
+} HeapHead;                 // Memory blocks follow the header
+
+// Arenas. Each thread allocates from an arena of its own - a heap w/a lock of
+// its own - so threads on different arenas never wait on each other. A thread
+// is assigned one round-robin at its first malloc, and if that one is busy
+// when it next needs it, moves to the first other one that isn't, waiting on
+// its own only if all are. Blocks are freed to the arena that owns them, found
+// by their address: the heap of each is carved from a g_reserve_sz-byte slot
+// of the addresses reserved for all of them at once, and only arena 0's heap
+// maps regions outside of its slot, so any block outside of them is its. An
+// idle arena's heap is freed, but its slot stays reserved for the next one.
+// There are as many arenas as CPUs the process may run on, up to ARENA_MAX,
+// unless set by the MEMORY_ARENAS env var. A real-time pool has just one, as
+// does the heap if the addresses for its slots can't be reserved.
+#define ARENA_MAX 64                        // Max num of arenas
+typedef struct Arena {
+    pthread_mutex_t lock;   // Held while the arena's heap is in use
+    HeapHead *heap;         // The arena's heap, or NULL if it has none
+    char *slot;             // Start of its slot of addresses, or NULL if
+                            //      there's only the one arena
+} Arena;
+
+static Arena g_arenas[ARENA_MAX] = {
+    [0 ... ARENA_MAX - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static size_t g_arena_count = 0;            // Num of arenas, or 0 for one
+                                            //      per CPU until arena_init
+static char *g_arena_base = NULL;           // Start of the arenas' slots
+static size_t g_arena_next = 0;             // Next arena to assign a thread
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+// This thread's arena, the one it allocates from
+static __thread Arena *t_arena __attribute__((tls_model("initial-exec")));
+
+// The heap ptr - the heap of the arena whose lock this thread holds, if any,
+// and that arena. Set by arena_lock and arena_lock_mine.
+static __thread HeapHead *g_heap __attribute__((tls_model("initial-exec")));
+static __thread Arena *g_arena __attribute__((tls_model("initial-exec")));
+
+// Requests of at least g_mmap_threshold bytes get a mapping of their own,
+// outside of g_heap. Like glibc's M_MMAP_THRESHOLD, the threshold rises to
+// the size of any such block freed, up to MMAP_THRESHOLD_MAX, unless set by
+// mallopt. These are read and written w/o any lock held.
+#define MMAP_THRESHOLD_MIN (128 * 1024)     // Initial mmap threshold
+#define MMAP_THRESHOLD_MAX (32 * 1048576)   // Max adaptive mmap threshold
+static size_t g_mmap_threshold = MMAP_THRESHOLD_MIN;
+static int g_mmap_threshold_fixed = 0;      // Nonzero once set by mallopt
+static size_t g_huge_sz = 0;                // Total sz of all such mappings
+static size_t g_huge_count = 0;             // Num of such mappings
+
+// Every data field is aligned to ALIGN_SZ, and every block size is a multiple
+// of it. Since a block's header is smaller than ALIGN_SZ, block headers sit
+// MAP_PAD_SZ bytes past an ALIGN_SZ boundary.
+#define ALIGN_SZ _Alignof(max_align_t)      // Alignment of all data fields
+#define ALIGN_UP(n) (((n) + ALIGN_SZ - 1) & ~(ALIGN_SZ - 1))  // Round to above
+#define PAGE_SZ 4096                        // Granularity of mmap'd mem
 
 #define START_HEAP_SZ (16 * 1048576)        // Heap megabytes * bytes in a mb
-#define BLOCK_HEAD_SZ sizeof(BlockHead)     // Size of BlockHead struct (bytes)
-#define HEAP_HEAD_SZ sizeof(HeapHead)       // Size of HeapHead struct (bytes)
-#define MIN_BLOCK_SZ (BLOCK_HEAD_SZ + 1)    // Min block sz = header + 1 byte
+#define BLOCK_HEAD_SZ offsetof(BlockHead, next)  // Sz of the true header
+#define HEAP_HEAD_SZ ALIGN_UP(sizeof(HeapHead))  // Sz of HeapHead, padded
 #define WORD_SZ sizeof(void*)               // Word size on this architecture
-
-static void block_add_tofree(BlockHead *block);
+#define FENCE_SZ WORD_SZ                    // Sz of the USED tag ending a map
+#define SEG_TAIL_SZ (FENCE_SZ + ALIGN_UP(sizeof(SegHead)))  // Fence + SegHead
+#define MAP_PAD_SZ (ALIGN_SZ - BLOCK_HEAD_SZ)  // Sz before a map's 1st block
+#define MIN_BLOCK_SZ ALIGN_UP(sizeof(BlockHead) + WORD_SZ)  // Head+links+foot
+
+// When g_heap's last block is freed, up to g_retain_sz bytes of it stay mapped
+// for reuse, until it's been idle for g_retain_ms. Mappings beyond that are
+// released at once. Set by the MEMORY_RETAIN_SZ and MEMORY_RETAIN_MS env vars,
+// or by mallopt(M_TRIM_THRESHOLD).
+#define RETAIN_SZ_DEFAULT START_HEAP_SZ     // Bytes kept mapped while idle
+#define RETAIN_MS_DEFAULT 1000              // Ms idle before they're released
+static size_t g_retain_sz = RETAIN_SZ_DEFAULT;
+static size_t g_retain_ms = RETAIN_MS_DEFAULT;
+
+// The heap's first mapping is carved out of g_reserve_sz bytes of address
+// space, reserved w/o access at init, and grows in place by committing more of
+// it. Only once that's used up does heap_expand map new regions elsewhere.
+// Set by the MEMORY_RESERVE_SZ env var.
+#define RESERVE_SZ_DEFAULT ((size_t)64 << 30)  // Bytes of addresses reserved
+#define TRIM_MIN_SZ START_HEAP_SZ           // Min sz free() gives back at once
+static size_t g_reserve_sz = RESERVE_SZ_DEFAULT;
+
+// Expansions that follow each other within GROW_MS each double in size, up to
+// GROW_MAX_SZ, so a fast-growing heap takes ever fewer misses. The background
+// thread, if any, also predicts demand from how much alloc_sz grew each tick,
+// and expands the heap ahead of it, prefaulting the new pages outside of the
+// lock if MEMORY_PREFAULT=1.
+#define GROW_MS 1000                        // Ms between "quick" expansions
+#define GROW_MAX_SZ (256 * 1048576)         // Max sz an expansion doubles to
+#define AHEAD_TICKS 4                       // Ticks of growth to keep ahead
+static size_t g_prefault = 0;               // Nonzero to prefault expansions
+
+// Real-time mode. If MEMORY_POOL_SZ is set, the heap is a pool of that many
+// bytes, committed and prefaulted at load time, and malloc and free run in
+// bounded time w/o syscalls: the heap never expands, trims, purges or unmaps,
+// requests of any size are served from it rather than from slabs or mappings
+// of their own, and the fit policy is tlsf unless MEMORY_FIT says otherwise.
+// A request that the pool can't serve fails.
+static size_t g_pool_sz = 0;
+static int g_fit = FIT_BEST;                // Placement policy, a FIT_* value
+static int g_config_done = 0;               // Nonzero once config_init ran
+
+// Free blocks of at least PURGE_MIN_SZ that aren't BLOCK_ZEROED are stamped w/
+// when they were freed, in a DecayTag after their links, and queued on their
+// heap's decay list in stamp order. Once g_decay_ms have passed, the whole
+// pages inside them are given back to the kernel, so RSS follows actual use
+// w/o refaulting mem that's reused right away. Set by the MEMORY_DECAY_MS env
+// var. MEMORY_PURGE_LAZY=1 purges w/MADV_FREE, which the kernel only acts on
+// under mem pressure, rather than w/MADV_DONTNEED. A free purges at most
+// PURGE_BATCH blocks, leaving the rest due for the next; the background
+// thread purges all that are due.
+#define PURGE_MIN_SZ (4 * PAGE_SZ)          // Min sz of a block worth purging
+#define PURGE_BATCH 8                       // Max blocks a free purges
+#define DECAY_MS_DEFAULT 10000              // Ms free pages stay resident
+static size_t g_decay_ms = DECAY_MS_DEFAULT;
+static size_t g_purge_lazy = 0;             // Nonzero to purge w/MADV_FREE
+
+// A stamped free block's place on the decay list.
+typedef struct DecayTag {
+    size_t stamp;           // When the block was freed, in ms, or 0 if it
+                            //      isn't on the list
+    BlockHead *next;        // Next newer stamped block
+    BlockHead *prev;        // Next older stamped block
+} DecayTag;
+
+// If MEMORY_BACKGROUND_MS is set, a background thread wakes every that many ms
+// to purge, trim and unmap what's due, and free() and thread exit leave that
+// to it, for each arena in turn. It's started by the first malloc or calloc
+// after heap_init, outside of any lock, and again in a forked child on its
+// next one.
+#define BG_OFF 0                            // No thread wanted
+#define BG_WANTED 1                         // Thread to be started
+#define BG_STARTING 2                       // Thread being started
+#define BG_RUNNING 3                        // Thread running
+#define BG_FAILED 4                         // Thread couldn't be started
+static size_t g_bg_ms = 0;
+static int g_bg_state = BG_OFF;             // One of the BG_* states above
+
+// Requests of at most SLAB_MAX_SZ bytes are served from slabs: pages cut into
+// equal slots of one size class, each a multiple of ALIGN_SZ. Slabs are carved
+// from g_slab_reserve_sz bytes of addresses reserved for them at first use,
+// alongside a flat page map - an array w/a PageDesc for each of those pages.
+// A ptr is thus known to be a slab object by its address, and its size class
+// and slot are found from its page's PageDesc, w/o a header of its own, and w/
+// no metadata in the slab pages themselves. The addresses are split evenly
+// between the arenas, each getting a slab heap - a share of them and of the
+// page map, w/a lock of its own - as many as have a share of at least
+// SLAB_COMMIT_SZ; any past those share theirs w/the first ones, round-robin.
+// Set by the MEMORY_SLAB_SZ env var - 0 disables slabs, and the spans below.
+#define SLAB_MAX_SZ 256                     // Max sz of a slab object
+#define SLAB_CLASSES (SLAB_MAX_SZ / ALIGN_SZ)  // Num of slab slot sizes
+#define SLAB_MAP_WORDS (PAGE_SZ / ALIGN_SZ / BINMAP_BITS)  // Words per freemap
+#define SLAB_COMMIT_SZ (256 * PAGE_SZ)      // Bytes of slabs committed at once
+#define SLAB_EMPTY_MAX 64                   // Max empty slabs kept resident
+#define SLAB_RESERVE_DEFAULT ((size_t)16 << 30)  // Bytes of addresses reserved
+static size_t g_slab_reserve_sz = SLAB_RESERVE_DEFAULT;
+
+// Requests of SPAN_MIN_SZ to SPAN_MAX_SZ bytes are served from spans - runs of
+// whole pages, carved from the same addresses as slabs and described by the
+// same page map - if rounding them up to whole pages wastes no more than
+// 1/2^SPAN_WASTE_SHIFT of them. Free spans are kept in lists by page count,
+// the last for every count too large for the others, and are merged w/the
+// free spans on either side of them, found through the page map. Free spans
+// are kept resident up to 1/2^SPAN_DIRTY_SHIFT of the allocated spans' size,
+// or SPAN_DIRTY_MAX bytes if that's more; the pages of those freed beyond that
+// are given back to the kernel, which affects no other object, as a span
+// shares none of its pages.
+#define SPAN_MIN_SZ PAGE_SZ                 // Min sz of a span request
+#define SPAN_MAX_SZ (256 * PAGE_SZ)         // Max sz of a span request
+#define SPAN_BINS (SPAN_MAX_SZ / PAGE_SZ)   // Num of free span lists
+#define SPAN_MAP_WORDS (SPAN_BINS / BINMAP_BITS)  // Words in the span bitmap
+#define SPAN_WASTE_SHIFT 3                  // log2(sz per byte wasted, at most)
+#define SPAN_DIRTY_MAX (1024 * PAGE_SZ)     // Free span bytes always kept resident
+#define SPAN_DIRTY_SHIFT 2                  // log2(span bytes per free one kept)
+
+// Page descriptor - the page map entry of a page reserved for slabs and spans.
+// The entries of a span's first and last pages describe the whole span, w/
+// slot_sz its size (at least PAGE_SZ, which tells a span from a slab), used
+// nonzero iff it's allocated, and slots nonzero iff it's free and known to be
+// all zero. The entries of the pages between them are unused.
+typedef struct PageDesc {
+    size_t slot_sz;             // Size of each of the slab's slots in bytes
+    size_t slots;               // Num of slots in the slab
+    size_t used;                // Num of slots allocated
+    struct PageDesc *next;      // Next slab of its class w/a free slot, or
+                                //      next empty slab, or next free span
+                                //      of its page count
+    struct PageDesc *prev;      // Prev slab of its class w/a free slot, or
+                                //      prev free span of its page count
+    size_t freemap[SLAB_MAP_WORDS];  // Bit i is set iff slot i is free
+} PageDesc;
+
+// A slab heap. Pages between "start" and "top" have all been slabs, and are
+// either in use or on the "empty" or "purged" lists, or are part of spans,
+// allocated or free; those between "top" and "commit_end" are ready to be
+// either. "descs" is its slice of the page map, committed in step w/the pages
+// it describes.
+typedef struct SlabHeap {
+    pthread_mutex_t lock;       // Held while the slab heap is in use
+    char *start;                // Ptr to first byte of the heap's share
+    char *end;                  // End of its share
+    char *top;                  // Start of the pages never yet used
+    char *commit_end;           // End of the usable part of its share
+    PageDesc *descs;            // Page map - the descriptor of each page
+    char *descs_end;            // End of the usable part of the page map
+    PageDesc *bins[SLAB_CLASSES];   // Heads of the lists of slabs w/free slots
+    PageDesc *empty;            // List of resident slabs w/no objects
+    PageDesc *purged;           // List of slabs whose pages were given back
+    size_t empty_count;         // Num of slabs on the "empty" list
+    size_t purged_count;        // Num of slabs on the "purged" list
+    size_t obj_count;           // Num of slab objects allocated
+    size_t slab_pages;          // Num of pages that have been slabs
+    PageDesc *spans[SPAN_BINS]; // Heads of the free span lists by page count
+    size_t spanmap[SPAN_MAP_WORDS];  // Bit i is set iff spans[i] is non-empty
+    size_t span_sz;             // Total sz of allocated spans
+    size_t span_count;          // Num of allocated spans
+    size_t span_dirty_sz;       // Total sz of free spans not known to be zero
+} SlabHeap;
+
+// The slab heaps, the first g_slab_count of them in use. An arena's lock may
+// be held while taking one's, but never the other way around.
+static SlabHeap g_slabs[ARENA_MAX] = {
+    [0 ... ARENA_MAX - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static size_t g_slab_count = 0;             // Num of slab heaps in use
+static char *g_slab_start = NULL;           // Start of all heaps' addresses
+static char *g_slab_end = NULL;             // End of them
+static size_t g_slab_share = 0;             // Sz of each heap's share
+static int g_slab_failed = 0;               // Nonzero if they couldn't be
+                                            //      reserved
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+
+// The slab heap whose lock this thread holds, if any. Set by slab_lock.
+static __thread SlabHeap *g_slab __attribute__((tls_model("initial-exec")));
+
+#define TCACHE_BINS 64                      // Num of thread cache classes
+#define TCACHE_MAX_SZ (TCACHE_BINS * ALIGN_SZ)  // Max sz served from the cache
+#define TCACHE_BIN_MAX 32                   // Max blocks cached per class
+#define TCACHE_BATCH (TCACHE_BIN_MAX / 2)   // Blocks per heap refill/flush
+
+#define TCACHE_UNINIT 0                     // Cache not yet set up
+#define TCACHE_INITING 1                    // Cache is being set up
+#define TCACHE_READY 2                      // Cache in use
+#define TCACHE_DEAD 3                       // Thread exiting, cache flushed
+
+// Per-thread cache of freed small blocks and slab objects, bucketed by usable
+// size - class i holds those w/at least (i + 1) * ALIGN_SZ usable bytes.
+// Cached blocks remain "allocated" as far as their heap is concerned, and are
+// linked together through the first word of their data fields.
+typedef struct ThreadCache {
+    void *bins[TCACHE_BINS];            // Head of each class's cached list
+    unsigned int counts[TCACHE_BINS];   // Num of blocks cached in each class
+    int state;                          // One of the TCACHE_* states above
+} ThreadCache;
+
+// This thread's cache, and the key that flushes it at thread exit
+static __thread ThreadCache t_cache __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// mem_set and mem_cpy run the widest variant the CPU supports, as chosen by
+// mem_init at load time. Until then, they run the word-wide variants.
+#define MEM_NT_DEFAULT (8 * 1048576)        // Non-temporal cutoff, w/o CPUID
+typedef size_t __attribute__((may_alias, aligned(1))) MemWord;
+static void *mem_set_word(void *s, int c, size_t n);
+static void *mem_cpy_word(void *dest, const void *src, size_t n);
+static void *(*g_mem_set)(void*, int, size_t) = mem_set_word;
+static void *(*g_mem_cpy)(void*, const void*, size_t) = mem_cpy_word;
+static size_t g_mem_nt_sz = MEM_NT_DEFAULT; // Fills/copies larger than the
+                                            //      last-level cache bypass it
+
+static BlockHead *block_add_tofree(BlockHead *block);
+static void bin_insert(BlockHead *block);
+static void bin_remove(BlockHead *block);
+static void block_dirty(BlockHead *block);
+static void block_undirty(BlockHead *block);
+static void *do_malloc(size_t size);
+static void do_free(void *ptr);
+static void heap_init();
+static void arena_lock_mine();
+static void arena_unlock();
+static void heap_prefault(char *start, size_t size);
+static BlockHead *heap_expand(size_t size);
+static size_t do_usable_size(void *ptr);
+static int bg_running();
+static void bg_want();
 
 
 /* End Definitions ------------------------------------------------------DF */
 /* Begin mem Helpers ----------------------------------------------------DF */
 
 
-/* -- mem_set -- */
-// Fills the first n bytes at s with c
+/* -- mem_set_word -- */
+// Fills the first n bytes at s with c, a word at a time.
 // RETURNS: ptr to s
-static void *mem_set(void *s, int c, size_t n) {
-    char *p = (char *)s;
-    while(n) {
-        *p = (char)c;
-        p++;
+static void *mem_set_word(void *s, int c, size_t n) {
+    unsigned char *p = s;
+    size_t word = (unsigned char)c * (~(size_t)0 / 0xff);
+
+    // Bytes up to the first aligned word, then whole words, then the rest
+    while (n && (size_t)p & (WORD_SZ - 1)) {
+        *p++ = (unsigned char)c;
         n--;
     }
-  return s;
+    for (; n >= WORD_SZ; n -= WORD_SZ, p += WORD_SZ)
+        *(MemWord*)p = word;
+    while (n--)
+        *p++ = (unsigned char)c;
+
+    return s;
 }
 
-/* -- mem_cpy -- */
-// Copies n bytes from src to dest (mem areas must not overlap)
+/* -- mem_cpy_word -- */
+// Copies n bytes from src to dest, a word at a time (mem areas must not
+// overlap).
 // RETURNS: ptr to dest
-static void *mem_cpy(void *dest, const void *src, size_t n) {
-    char *pd = dest;
-    const char *ps = src;
-    while (n) {
-        *pd = *ps;
-        pd++;
-        ps++;
+static void *mem_cpy_word(void *dest, const void *src, size_t n) {
+    unsigned char *pd = dest;
+    const unsigned char *ps = src;
+
+    // Align the stores; the loads may stay unaligned
+    while (n && (size_t)pd & (WORD_SZ - 1)) {
+        *pd++ = *ps++;
         n--;
     }
+    for (; n >= WORD_SZ; n -= WORD_SZ, pd += WORD_SZ, ps += WORD_SZ)
+        *(MemWord*)pd = *(const MemWord*)ps;
+    while (n--)
+        *pd++ = *ps++;
+
+    return dest;
+}
+
+#if defined(__x86_64__)
+/* -- mem_set_sse2 -- */
+// As mem_set_word, but 16 bytes at a time. Fills larger than g_mem_nt_sz use
+// non-temporal stores, so they don't evict the whole cache.
+static void *mem_set_sse2(void *s, int c, size_t n) {
+    if (n < 64)
+        return mem_set_word(s, c, n);
+
+    __m128i v = _mm_set1_epi8((char)c);
+    unsigned char *p = s;
+    unsigned char *end = p + n;
+
+    // Cover the unaligned head w/one store, then go aligned
+    _mm_storeu_si128((__m128i*)p, v);
+    p = (unsigned char*)(((size_t)p + 16) & ~(size_t)15);
+
+    if (n > g_mem_nt_sz) {
+        for (; p + 16 <= end; p += 16)
+            _mm_stream_si128((__m128i*)p, v);
+        _mm_sfence();
+    } else {
+        for (; p + 16 <= end; p += 16)
+            _mm_store_si128((__m128i*)p, v);
+    }
+
+    // Cover the tail w/one store ending at the last byte
+    _mm_storeu_si128((__m128i*)(end - 16), v);
+    return s;
+}
+
+/* -- mem_cpy_sse2 -- */
+// As mem_cpy_word, but 16 bytes at a time. Copies larger than g_mem_nt_sz use
+// non-temporal stores, so they don't evict the whole cache.
+static void *mem_cpy_sse2(void *dest, const void *src, size_t n) {
+    if (n < 64)
+        return mem_cpy_word(dest, src, n);
+
+    unsigned char *pd = dest;
+    const unsigned char *ps = src;
+    __m128i tail = _mm_loadu_si128((const __m128i*)(ps + n - 16));
+    unsigned char *end = pd + n;
+
+    // Cover the unaligned head w/one store, then go aligned
+    _mm_storeu_si128((__m128i*)pd, _mm_loadu_si128((const __m128i*)ps));
+    size_t skip = 16 - ((size_t)pd & 15);
+    pd += skip;
+    ps += skip;
+
+    if (n > g_mem_nt_sz) {
+        for (; pd + 16 <= end; pd += 16, ps += 16)
+            _mm_stream_si128((__m128i*)pd,
+                             _mm_loadu_si128((const __m128i*)ps));
+        _mm_sfence();
+    } else {
+        for (; pd + 16 <= end; pd += 16, ps += 16)
+            _mm_store_si128((__m128i*)pd, _mm_loadu_si128((const __m128i*)ps));
+    }
+
+    _mm_storeu_si128((__m128i*)(end - 16), tail);
+    return dest;
+}
+
+/* -- mem_set_avx2 -- */
+// As mem_set_sse2, but 32 bytes at a time.
+__attribute__((target("avx2")))
+static void *mem_set_avx2(void *s, int c, size_t n) {
+    if (n < 128)
+        return mem_set_sse2(s, c, n);
+
+    __m256i v = _mm256_set1_epi8((char)c);
+    unsigned char *p = s;
+    unsigned char *end = p + n;
+
+    _mm256_storeu_si256((__m256i*)p, v);
+    p = (unsigned char*)(((size_t)p + 32) & ~(size_t)31);
+
+    if (n > g_mem_nt_sz) {
+        for (; p + 32 <= end; p += 32)
+            _mm256_stream_si256((__m256i*)p, v);
+        _mm_sfence();
+    } else {
+        for (; p + 32 <= end; p += 32)
+            _mm256_store_si256((__m256i*)p, v);
+    }
+
+    _mm256_storeu_si256((__m256i*)(end - 32), v);
+    return s;
+}
+
+/* -- mem_cpy_avx2 -- */
+// As mem_cpy_sse2, but 32 bytes at a time.
+__attribute__((target("avx2")))
+static void *mem_cpy_avx2(void *dest, const void *src, size_t n) {
+    if (n < 128)
+        return mem_cpy_sse2(dest, src, n);
+
+    unsigned char *pd = dest;
+    const unsigned char *ps = src;
+    __m256i tail = _mm256_loadu_si256((const __m256i*)(ps + n - 32));
+    unsigned char *end = pd + n;
+
+    _mm256_storeu_si256((__m256i*)pd, _mm256_loadu_si256((const __m256i*)ps));
+    size_t skip = 32 - ((size_t)pd & 31);
+    pd += skip;
+    ps += skip;
+
+    if (n > g_mem_nt_sz) {
+        for (; pd + 32 <= end; pd += 32, ps += 32)
+            _mm256_stream_si256((__m256i*)pd,
+                                _mm256_loadu_si256((const __m256i*)ps));
+        _mm_sfence();
+    } else {
+        for (; pd + 32 <= end; pd += 32, ps += 32)
+            _mm256_store_si256((__m256i*)pd,
+                               _mm256_loadu_si256((const __m256i*)ps));
+    }
 
+    _mm256_storeu_si256((__m256i*)(end - 32), tail);
     return dest;
 }
 
+/* -- mem_llc_size -- */
+// Returns: The size of the CPU's last-level cache in bytes, per CPUID, or 0 if
+//      it doesn't say.
+static size_t mem_llc_size() {
+    unsigned int eax, ebx, ecx, edx;
+    size_t llc_sz = 0;
+
+    // Intel: walk the deterministic cache parameters leaf
+    if (__get_cpuid_max(0, NULL) >= 4) {
+        for (unsigned int i = 0; ; i++) {
+            __cpuid_count(4, i, eax, ebx, ecx, edx);
+            if (!(eax & 0x1f))
+                break;
+            size_t ways = (ebx >> 22) + 1;
+            size_t parts = ((ebx >> 12) & 0x3ff) + 1;
+            size_t line = (ebx & 0xfff) + 1;
+            size_t sz = ways * parts * line * ((size_t)ecx + 1);
+            if (sz > llc_sz)
+                llc_sz = sz;
+        }
+    }
+
+    // AMD: L3 size, in 512KB units
+    if (!llc_sz && __get_cpuid(0x80000006, &eax, &ebx, &ecx, &edx))
+        llc_sz = (size_t)(edx >> 18) * 512 * 1024;
+
+    return llc_sz;
+}
+
+/* -- mem_has_avx2 -- */
+// Returns: Nonzero iff the CPU supports AVX2 and the OS saves the ymm regs.
+static int mem_has_avx2() {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+        return 0;
+
+    unsigned int xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 0x6) != 0x6)
+        return 0;
+
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) != 0;
+}
+#endif
+
+/* -- mem_init -- */
+// Picks the mem_set and mem_cpy variants for this CPU. Runs at load time.
+__attribute__((constructor))
+static void mem_init() {
+#if defined(__x86_64__)
+    size_t llc_sz = mem_llc_size();
+    if (llc_sz)
+        g_mem_nt_sz = llc_sz;
+
+    // SSE2 is part of the x86-64 baseline
+    if (mem_has_avx2()) {
+        g_mem_set = mem_set_avx2;
+        g_mem_cpy = mem_cpy_avx2;
+    } else {
+        g_mem_set = mem_set_sse2;
+        g_mem_cpy = mem_cpy_sse2;
+    }
+#endif
+}
+
+/* -- mem_set -- */
+// Fills the first n bytes at s with c
+// RETURNS: ptr to s
+static void *mem_set(void *s, int c, size_t n) {
+    return g_mem_set(s, c, n);
+}
+
+/* -- mem_cpy -- */
+// Copies n bytes from src to dest (mem areas must not overlap)
+// RETURNS: ptr to dest
+static void *mem_cpy(void *dest, const void *src, size_t n) {
+    return g_mem_cpy(dest, src, n);
+}
+
 /* -- sizet_multiply -- */
 // Multiplies the given icand and iplier to ensure product not size_t overflow
 // Adapted from __try_size_t_multiply, clauter 2018.
@@ -147,6 +742,135 @@ static size_t sizet_multiply(size_t a, size_t b) {
     return t;
 }
 
+/* -- env_get -- */
+// Returns: The value of the environment variable "name", or NULL if it's
+//      unset. Reads environ directly, as getenv may not be safe to call
+//      before libc is set up.
+static const char *env_get(const char *name) {
+    extern char **environ;
+    if (!environ)
+        return NULL;
+
+    for (char **env = environ; *env; env++) {
+        // Skip variables whose name doesn't match
+        const char *p = *env;
+        const char *n = name;
+        while (*n && *p == *n) {
+            p++;
+            n++;
+        }
+        if (!*n && *p == '=')
+            return p + 1;
+    }
+    return NULL;
+}
+
+/* -- env_size -- */
+// Reads a size from the environment variable "name", as a decimal num w/an
+//      optional K, M or G suffix.
+// Returns: The size read, or "dflt" if the variable is unset or malformed.
+static size_t env_size(const char *name, size_t dflt) {
+    const char *p = env_get(name);
+    if (!p || *p < '0' || *p > '9')
+        return dflt;
+
+    size_t val = 0;
+    while (*p >= '0' && *p <= '9') {
+        if (val > ((size_t)-1 - 9) / 10)
+            return dflt;
+        val = val * 10 + (size_t)(*p++ - '0');
+    }
+
+    int shift = 0;
+    switch (*p) {
+        case 'K': case 'k': shift = 10; p++; break;
+        case 'M': case 'm': shift = 20; p++; break;
+        case 'G': case 'g': shift = 30; p++; break;
+    }
+    if (*p || val > (size_t)-1 >> shift)
+        return dflt;
+    return val << shift;
+}
+
+/* -- env_fit -- */
+// Reads a placement policy from the environment variable "name", by the
+//      policy's name (see FIT_BEST).
+// Returns: The FIT_* value read, or "dflt" if the variable is unset or names
+//      no policy.
+static int env_fit(const char *name, int dflt) {
+    static const char *const names[] = { "best", "first", "next", "lifo",
+                                         "tlsf" };
+    const char *val = env_get(name);
+    if (!val)
+        return dflt;
+
+    for (int fit = 0; fit < (int)(sizeof(names) / sizeof(*names)); fit++) {
+        const char *p = val;
+        const char *n = names[fit];
+        while (*n && *p == *n) {
+            p++;
+            n++;
+        }
+        if (!*n && !*p)
+            return fit;
+    }
+    return dflt;
+}
+
+/* -- config_init -- */
+// Reads the MEMORY_* tunables from the environment. Runs at load time, or at
+//      the first heap_init or slab_init if that's sooner, so the heap's layout
+//      never changes under it.
+__attribute__((constructor))
+static void config_init() {
+    if (g_config_done)
+        return;
+    g_config_done = 1;
+
+    g_retain_sz = env_size("MEMORY_RETAIN_SZ", g_retain_sz);
+    g_retain_ms = env_size("MEMORY_RETAIN_MS", g_retain_ms);
+    g_reserve_sz = env_size("MEMORY_RESERVE_SZ", g_reserve_sz) &
+                   ~(size_t)(PAGE_SZ - 1);
+    g_decay_ms = env_size("MEMORY_DECAY_MS", g_decay_ms);
+    g_purge_lazy = env_size("MEMORY_PURGE_LAZY", g_purge_lazy);
+    g_bg_ms = env_size("MEMORY_BACKGROUND_MS", g_bg_ms);
+    g_prefault = env_size("MEMORY_PREFAULT", g_prefault);
+    g_slab_reserve_sz = env_size("MEMORY_SLAB_SZ", g_slab_reserve_sz);
+    g_pool_sz = env_size("MEMORY_POOL_SZ", g_pool_sz);
+    g_fit = env_fit("MEMORY_FIT", g_pool_sz ? FIT_TLSF : g_fit);
+    g_arena_count = env_size("MEMORY_ARENAS", g_arena_count);
+    if (g_arena_count > ARENA_MAX)
+        g_arena_count = ARENA_MAX;
+
+    // A pool is served from the heap alone, at whatever size
+    if (g_pool_sz) {
+        g_mmap_threshold = (size_t)-1;
+        g_mmap_threshold_fixed = 1;
+    }
+}
+
+/* -- pool_init -- */
+// Sets up a real-time pool at load time, so no malloc has to.
+__attribute__((constructor))
+static void pool_init() {
+    config_init();
+    if (!g_pool_sz)
+        return;
+
+    arena_lock_mine();
+    if (!g_heap)
+        heap_init();
+    arena_unlock();
+}
+
+/* -- now_ms -- */
+// Returns: The time, in ms, on a clock that only moves forward.
+static size_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (size_t)ts.tv_sec * 1000 + (size_t)ts.tv_nsec / 1000000;
+}
+
 /* -- do_mmap -- */
 // Allocates a new mem space of "size" bytes using the mmap syscall.
 // Returns: On suceess, a ptr to the mapped address space, else NULL.
@@ -161,6 +885,37 @@ static void *do_mmap(size_t size) {
     return result;
 }
 
+/* -- do_reserve -- */
+// Reserves "size" bytes of address space, w/o access or backing memory.
+// Returns: On suceess, a ptr to the reserved address space, else NULL.
+static void *do_reserve(size_t size) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    void *result = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+
+    if (result == MAP_FAILED)
+        result = NULL;
+
+    return result;
+}
+
+/* -- do_commit -- */
+// Makes the "size" bytes of reserved address space at "addr" usable.
+// Returns: 0 on success, or -1 on fail.
+static int do_commit(void *addr, size_t size) {
+    return mprotect(addr, size, PROT_EXEC | PROT_READ | PROT_WRITE);
+}
+
+/* -- do_decommit -- */
+// Returns the "size" bytes of usable mem at "addr" to being just reserved,
+// discarding their contents and backing memory.
+// Returns: 0 on success, or -1 on fail.
+static int do_decommit(void *addr, size_t size) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED;
+    if (mmap(addr, size, PROT_NONE, flags, -1, 0) == MAP_FAILED)
+        return -1;
+    return 0;
+}
+
 /* -- do_munmap -- */
 // Unmaps the memory at "addr" of "size" bytes using the munmap syscall.
 // Returns: Nonzero on success, or -1 on fail.
@@ -170,88 +925,301 @@ static int do_munmap(void *addr, size_t size) {
     return munmap(addr, size);
 }
 
+/* -- block_size -- */
+// Returns: The size of the given block, with header, in bytes.
+static size_t block_size(BlockHead *block) {
+    return block->size & ~(size_t)BLOCK_FLAGS;
+}
+
+/* -- block_next -- */
+// Returns: A ptr to the block (or fence) physically following the given one.
+static BlockHead *block_next(BlockHead *block) {
+    return (BlockHead*)((char*)block + block_size(block));
+}
+
+/* -- block_prev -- */
+// Returns: A ptr to the block physically preceding the given one.
+// Assumes: That block is free, i.e. BLOCK_PREV_USED is not set on this one.
+static BlockHead *block_prev(BlockHead *block) {
+    return (BlockHead*)((char*)block - ((size_t*)block)[-1]);
+}
+
+/* -- block_setfree -- */
+// Marks the given block free, w/the given size, writing its footer and
+// clearing the BLOCK_PREV_USED flag of the block after it.
+static void block_setfree(BlockHead *block, size_t size) {
+    block->size = size | (block->size & BLOCK_PREV_USED);
+    *(size_t*)((char*)block + size - WORD_SZ) = size;
+    block_next(block)->size &= ~(size_t)BLOCK_PREV_USED;
+}
+
+/* -- block_setused -- */
+// Marks the given block allocated, setting the BLOCK_PREV_USED flag of the
+// block after it.
+static void block_setused(BlockHead *block) {
+    block->size |= BLOCK_USED;
+    block_next(block)->size |= BLOCK_PREV_USED;
+
+    g_heap->stats.alloc_sz += block_size(block);
+    g_heap->stats.alloc_count++;
+}
+
+/* -- heap_addmap -- */
+// Adds a newly mapped region of "size" bytes at "map" to the heap's registry,
+// and formats all of it past its first "skip" bytes as a single free block,
+// ended by a fence that the block never coalesces past.
+// Assumes: "map", "size" and "skip" are multiples of ALIGN_SZ.
+// Returns: A ptr to the new free block.
+static BlockHead *heap_addmap(char *map, size_t size, size_t skip) {
+    BlockHead *block = (BlockHead*)(map + skip + MAP_PAD_SZ);
+    BlockHead *fence = (BlockHead*)(map + size - SEG_TAIL_SZ);
+    SegHead *seg = (SegHead*)((char*)fence + FENCE_SZ);
+
+    seg->start = map;
+    seg->size = size;
+    seg->prev = NULL;
+    seg->next = g_heap->segs;
+    if (seg->next)
+        seg->next->prev = seg;
+    g_heap->segs = seg;
+
+    fence->size = BLOCK_USED;
+    block->size = (size_t)((char*)fence - (char*)block) | BLOCK_USED |
+                  BLOCK_PREV_USED | BLOCK_ZEROED;
+    block_add_tofree(block);
+
+    g_heap->stats.mapped_sz += size;
+    g_heap->stats.map_count++;
+
+    return block;
+}
+
+/* -- seg_move -- */
+// Moves the given mapping's trailer to "to", keeping its place in the registry.
+static SegHead *seg_move(SegHead *seg, SegHead *to) {
+    *to = *seg;
+    if (to->prev)
+        to->prev->next = to;
+    else
+        g_heap->segs = to;
+    if (to->next)
+        to->next->prev = to;
+    return to;
+}
+
 /* -- heap_init -- */
-// Inits the global heap with one free memory block of maximal size.
+// Inits the heap of the arena held, g_arena, with one free memory block of
+//      maximal size.
 static void heap_init() {
-    // Allocate the heap and its first free mem block
-    size_t first_block_sz = START_HEAP_SZ - HEAP_HEAD_SZ;
-    g_heap = do_mmap(START_HEAP_SZ);
-    BlockHead *first_block = (BlockHead*)((void*)g_heap + HEAP_HEAD_SZ);
+    config_init();
+
+    // Allocate the heap at the start of the arena's slot, or of addresses
+    // reserved for it alone, if able, noting that its size class lists start
+    // out empty, as fresh mmap'd memory is zeroed. Only arena 0's heap may
+    // start outside of its slot.
+    char *reserve_end = NULL;
+    if (g_arena->slot) {
+        g_heap = do_commit(g_arena->slot, START_HEAP_SZ) ?
+                 NULL : (HeapHead*)g_arena->slot;
+    } else {
+        g_heap = g_reserve_sz > START_HEAP_SZ ? do_reserve(g_reserve_sz) : NULL;
+        if (g_heap && do_commit(g_heap, START_HEAP_SZ)) {
+            do_munmap(g_heap, g_reserve_sz);
+            g_heap = NULL;
+        }
+    }
+    if (g_heap)
+        reserve_end = (char*)g_heap + g_reserve_sz;
+    else if (g_arena == g_arenas)
+        g_heap = do_mmap(START_HEAP_SZ);
 
-    if (!g_heap || !first_block)
+    if (!g_heap)
         return;
 
-    // Init the memory block
-    first_block->size = first_block_sz;
-    first_block->data_addr = (char*)first_block + BLOCK_HEAD_SZ;
-    first_block->next = NULL;
-    first_block->prev = NULL;
-
-    // Init the heap and add the block to it's "free" list
-    g_heap->size = START_HEAP_SZ;
     g_heap->start_addr = (char*)g_heap;
-    g_heap->first_free = first_block;
+    g_heap->commit_end = (char*)g_heap + START_HEAP_SZ;
+    g_heap->reserve_end = reserve_end;
+
+    bg_want();
+
+    // Add the rest of the mapping to the heap as its first free block
+    heap_addmap((char*)g_heap, START_HEAP_SZ, HEAP_HEAD_SZ);
+
+    // Expand a real-time pool to its full size, and fault it all in, now
+    if (g_pool_sz) {
+        if (g_pool_sz > START_HEAP_SZ)
+            heap_expand(g_pool_sz - START_HEAP_SZ);
+        for (SegHead *seg = g_heap->segs; seg; seg = seg->next)
+            heap_prefault(seg->start, seg->size);
+    }
 }
 
-/* -- heap_expand -- */
-// Adds a new block of at least "size" bytes to the heap. If "size" is less
-//      than START_HEAP_SZ, START_HEAP_SZ bytes is added instead.
-// Returns: On success, a ptr to the new block created, else NULL.
-static BlockHead *heap_expand(size_t size) {
-    if (size < START_HEAP_SZ)
-        size = START_HEAP_SZ;
+/* -- heap_grow -- */
+// Commits the next "size" bytes of the heap's reserved addresses, extending
+//      its first mapping. The mapping's fence and trailer move to the new end,
+//      and the space between becomes a free block, merged w/the one before it
+//      if that one's free.
+// Assumes: "size" is a multiple of PAGE_SZ, and that much is still reserved.
+// Returns: On success, a ptr to the resulting free block, else NULL.
+static BlockHead *heap_grow(size_t size) {
+    char *old_end = g_heap->commit_end;
+    if (do_commit(old_end, size))
+        return NULL;
+
+    BlockHead *block = (BlockHead*)(old_end - SEG_TAIL_SZ);
+    SegHead *seg = (SegHead*)(old_end - ALIGN_UP(sizeof(SegHead)));
+    BlockHead *fence = (BlockHead*)(old_end + size - SEG_TAIL_SZ);
+
+    seg = seg_move(seg, (SegHead*)((char*)fence + FENCE_SZ));
+    seg->size += size;
+    g_heap->commit_end += size;
+    g_heap->stats.mapped_sz += size;
+
+    // The old fence becomes the new block's header, the old trailer part of
+    // its zeroed data
+    fence->size = BLOCK_USED;
+    mem_set((char*)block + FENCE_SZ, 0, ALIGN_UP(sizeof(SegHead)));
+    block->size = (size_t)((char*)fence - (char*)block) | BLOCK_USED |
+                  (block->size & BLOCK_PREV_USED) | BLOCK_ZEROED;
+    return block_add_tofree(block);
+}
 
-    // Allocate the new space as a memory block
-    BlockHead *new_block = do_mmap(size);
+/* -- heap_trim_top -- */
+// Returns the free end of the heap's first mapping to its reserved addresses,
+//      leaving at least START_HEAP_SZ bytes, until no more than "limit" bytes
+//      remain mapped. Does nothing unless at least "min" bytes would go.
+static void heap_trim_top(size_t limit, size_t min) {
+    char *end = g_heap->commit_end;
+    BlockHead *fence = (BlockHead*)(end - SEG_TAIL_SZ);
+    if (!g_heap->reserve_end || fence->size & BLOCK_PREV_USED ||
+        g_heap->stats.mapped_sz <= limit)
+        return;
 
-    if (!new_block)
-         return NULL;  
+    // Find the new end, keeping the top block big enough to be a block
+    BlockHead *top = block_prev(fence);
+    char *new_end = end - (g_heap->stats.mapped_sz - limit);
+    if (new_end < (char*)top + MIN_BLOCK_SZ + SEG_TAIL_SZ)
+        new_end = (char*)top + MIN_BLOCK_SZ + SEG_TAIL_SZ;
+    if (new_end < g_heap->start_addr + START_HEAP_SZ)
+        new_end = g_heap->start_addr + START_HEAP_SZ;
+    new_end = (char*)(((size_t)new_end + PAGE_SZ - 1) & ~(size_t)(PAGE_SZ - 1));
+    if (new_end >= end || (size_t)(end - new_end) < min)
+        return;
 
-    // Init the new block
-    new_block->size = size;
-    new_block->data_addr = (char*)new_block + BLOCK_HEAD_SZ;
-    new_block->next = NULL;
-    new_block->prev = NULL;
+    // Shorten the top block, then move the fence and trailer down to it
+    size_t zeroed = top->size & BLOCK_ZEROED;
+    BlockHead *new_fence = (BlockHead*)(new_end - SEG_TAIL_SZ);
+    SegHead *seg = (SegHead*)(end - ALIGN_UP(sizeof(SegHead)));
+
+    bin_remove(top);
+    seg = seg_move(seg, (SegHead*)((char*)new_fence + FENCE_SZ));
+    seg->size -= (size_t)(end - new_end);
+    new_fence->size = BLOCK_USED;
+    block_setfree(top, (size_t)((char*)new_fence - (char*)top));
+    top->size |= zeroed;
+    bin_insert(top);
+    block_dirty(top);
+
+    do_decommit(new_end, (size_t)(end - new_end));
+    g_heap->stats.mapped_sz -= (size_t)(end - new_end);
+    g_heap->commit_end = new_end;
+}
 
-    // Denote new size of the heap and add the new block as free
-    g_heap->size += size;
-    block_add_tofree(new_block);
+/* -- heap_add -- */
+// Adds "size" bytes to the heap, growing its first mapping in place if there's
+//      reserved room for it - or, if there's less room than that but at least
+//      "need" bytes, what room there is - else mapping a new region.
+// Returns: On success, a ptr to the resulting free block, else NULL.
+static BlockHead *heap_add(size_t size, size_t need) {
+    size_t room = g_heap->reserve_end ?
+                  (size_t)(g_heap->reserve_end - g_heap->commit_end) : 0;
+    if (size > room && need <= room)
+        size = room;
+    if (size <= room) {
+        BlockHead *block = heap_grow(size);
+        if (block)
+            return block;
+    }
 
-    return new_block;
+    // Allocate the new space as a memory block, unless the heap is another
+    // arena's than arena 0's, whose blocks must all be in its slot
+    if (g_arena->slot && g_arena != g_arenas)
+        return NULL;
+    void *new_map = do_mmap(size);
+
+    if (!new_map)
+         return NULL;  
+
+    // Add the new block to the heap as free
+    return heap_addmap(new_map, size, 0);
+}
+
+/* -- heap_expand -- */
+// Adds a new block of at least "size" bytes to the heap. If "size" is less
+//      than START_HEAP_SZ, START_HEAP_SZ bytes is added instead.
+// Returns: On success, a ptr to the new block created, else NULL.
+static BlockHead *heap_expand(size_t size) {
+    size = (size + MAP_PAD_SZ + SEG_TAIL_SZ + PAGE_SZ - 1) &
+           ~(size_t)(PAGE_SZ - 1);
+    size_t need = size;
+
+    // Expand by at least grow_sz, doubling it if the last expansion was recent
+    size_t now = now_ms();
+    if (!g_heap->grow_sz || now - g_heap->grown_at >= GROW_MS)
+        g_heap->grow_sz = START_HEAP_SZ;
+    else if (g_heap->grow_sz < GROW_MAX_SZ)
+        g_heap->grow_sz *= 2;
+    g_heap->grown_at = now;
+    if (size < g_heap->grow_sz)
+        size = g_heap->grow_sz;
+
+    // If that much can't be had, as under a mem limit, settle for what the
+    // request needs, and start doubling over
+    BlockHead *block = heap_add(size, need);
+    if (!block && size > need) {
+        g_heap->grow_sz = 0;
+        block = heap_add(need, need);
+    }
+    return block;
 }
 
 /* -- block_chunk -- */
-// Repartitions the given block to the size specified, if able.
-// Assumes: The block is "free" and size given includes room for header.
+// Repartitions the given block to the size specified, if able, returning
+//      the excess to the "free" lists.
+// Assumes: The block is allocated and size given includes room for header.
 // Returns: A ptr to the original block, resized or not, depending on if able.
 static BlockHead *block_chunk(BlockHead *block, size_t size) {
     // Denote split address and resulting sizes
     BlockHead *block2 = (BlockHead*)((char*)block + size);
-    size_t b2_size = block->size - size;
-    size_t b1_size = block->size - b2_size;
-    
-    if (!block2)
-         return NULL;
-
-    // Ensure partitions are large enough to be split
-    if (b2_size >= MIN_BLOCK_SZ && b1_size >= MIN_BLOCK_SZ) {
-        block->size = b1_size;
-        block2->size = b2_size;
-        block2->data_addr = (char*)block2 + BLOCK_HEAD_SZ;
-
-        // Insert the new block between original block and the next (if any)
-        // We do this here, rather than with block_add_tofree(), to avoid the
-        // overhead of finding the list insertion point - we already know it.
-        if (block->next)
-            block->next->prev = block2;
-        block2->next = block->next;
-        block->next = block2;
-        block2->prev = block;
+    size_t b2_size = block_size(block) - size;
+
+    // Ensure the excess is large enough to be split off
+    if (b2_size >= MIN_BLOCK_SZ) {
+        block->size = size | (block->size & BLOCK_FLAGS);
+        block2->size = b2_size | BLOCK_USED | BLOCK_PREV_USED |
+                       (block->size & BLOCK_ZEROED);
+        block_add_tofree(block2);
+        g_heap->stats.alloc_sz -= b2_size;
     }
 
     return block;
 }
 
+/* -- block_getdata --*/
+// Given a ptr to a mem block header, returns a ptr to that block's data field.
+static void *block_getdata(BlockHead *block) {
+    return (char*)block + BLOCK_HEAD_SZ;
+}
+
+/* -- block_datasize --*/
+// Returns: The num of bytes in the given allocated block's data field.
+static size_t block_datasize(BlockHead *block) {
+    // A mmapped block's size is that of its whole mapping, pad included
+    if (block->size & BLOCK_MMAPPED)
+        return block_size(block) - MAP_PAD_SZ - BLOCK_HEAD_SZ;
+    return block_size(block) - BLOCK_HEAD_SZ;
+}
+
 /* -- block_getheader --*/
 // Given a ptr a to a data field, returns a ptr that field's mem block header.
 BlockHead *block_getheader(void *ptr) {
@@ -260,54 +1228,172 @@ BlockHead *block_getheader(void *ptr) {
     return (BlockHead*)((void*)ptr - BLOCK_HEAD_SZ);
 }
 
+/* -- block_reqsize --*/
+// Returns: The size of the block, w/header, that serves a data field of "size"
+//      bytes, or 0 if that size would overflow.
+static size_t block_reqsize(size_t size) {
+    if (size > (size_t)-1 - BLOCK_HEAD_SZ - START_HEAP_SZ)
+        return 0;
+
+    size = ALIGN_UP(size + BLOCK_HEAD_SZ);
+    if (size < MIN_BLOCK_SZ)
+        size = MIN_BLOCK_SZ;
+    return size;
+}
+
+/* -- seg_spanned -- */
+// Returns: The mapping that the given free block spans all of, or NULL if it
+//      doesn't. The heap's first mapping, holding HeapHead, never qualifies.
+static SegHead *seg_spanned(BlockHead *block) {
+    BlockHead *fence = block_next(block);
+    if (block_size(fence))
+        return NULL;
+
+    SegHead *seg = (SegHead*)((char*)fence + FENCE_SZ);
+    if ((char*)block != seg->start + MAP_PAD_SZ)
+        return NULL;
+    return seg;
+}
+
+/* -- seg_unmap -- */
+// Removes the given mapping from the heap and unmaps it.
+// Assumes: The mapping is a single free block, and isn't the heap's first.
+static void seg_unmap(SegHead *seg) {
+    char *start = seg->start;
+    size_t size = seg->size;
+
+    bin_remove((BlockHead*)(start + MAP_PAD_SZ));
+
+    if (seg->prev)
+        seg->prev->next = seg->next;
+    else
+        g_heap->segs = seg->next;
+    if (seg->next)
+        seg->next->prev = seg->prev;
+
+    g_heap->stats.mapped_sz -= size;
+    g_heap->stats.map_count--;
+    do_munmap(start, size);
+}
+
 /* -- heap_free -- */
-// Frees all unallocated memory blocks, and then the heap itself.
-// Assumes: When this function is called, all blocks in the heap are free and
-// all contiguous blocks have been combined.
+// Unmaps every mapping in the heap's registry, and then the heap itself.
+// Assumes: When this function is called, all blocks in the heap are free.
 static void heap_free() {
     if (!g_heap) 
         return;
 
-    BlockHead *curr = g_heap->first_free;
-    while(curr && curr->next) {
-        // Advance in list until finding a non-contiguous next block
-        if (((char*)curr + curr->size) != (char*)curr->next)  {
-            // Free that next block
-            BlockHead *freeme = curr->next;
-            curr = curr->next->next;
+    // Unmap every mapping added by heap_expand
+    SegHead *seg = g_heap->segs;
+    while (seg) {
+        SegHead *next = seg->next;
+        if (seg->start != (char*)g_heap)
+            do_munmap(seg->start, seg->size);
+        seg = next;
+    }
 
-            g_heap->size -= freeme->size;
-            do_munmap(freeme, freeme->size);
+    // The only mapping left is the one the heap started with, which can be
+    // freed all at once with the header and any addresses reserved after it -
+    // unless those are the arena's slot, which just goes back to reserved
+    if ((char*)g_heap == g_arena->slot)
+        do_decommit((void*)g_heap,
+                    (size_t)(g_heap->commit_end - (char*)g_heap));
+    else if (g_heap->reserve_end)
+        do_munmap((void*)g_heap, (size_t)(g_heap->reserve_end - (char*)g_heap));
+    else
+        do_munmap((void*)g_heap, START_HEAP_SZ);
+    g_heap = NULL;
+}
 
-        } else {
-            curr = curr->next;
-        }
+/* -- heap_shrink -- */
+// Unmaps the mappings added by heap_expand that are wholly free, then the
+//      free end of the first mapping, until no more than "limit" bytes remain
+//      mapped. If that's not enough and no blocks are allocated, frees the
+//      heap.
+static void heap_shrink(size_t limit) {
+    SegHead *seg = g_heap->segs;
+    while (seg && g_heap->stats.mapped_sz > limit) {
+        SegHead *next = seg->next;
+        BlockHead *first = (BlockHead*)(seg->start + MAP_PAD_SZ);
+        if (seg->start != (char*)g_heap && !(first->size & BLOCK_USED) &&
+            seg_spanned(first))
+            seg_unmap(seg);
+        seg = next;
     }
 
-    // The only block left should now be the single block the heap started with,
-    // which can be freed all at once with the header
-    do_munmap((void*)g_heap, g_heap->size);
-    g_heap = NULL;
+    heap_trim_top(limit, 0);
+    if (g_heap->stats.mapped_sz > limit && !g_heap->stats.alloc_count)
+        heap_free();
+}
+
+/* -- heap_idle -- */
+// Called when the heap's last allocated block is freed. Keeps up to g_retain_sz
+//      bytes of it mapped, so that an alloc/free cycle doesn't have to mmap
+//      and munmap the heap each time, and notes when it went idle.
+static void heap_idle() {
+    heap_shrink(g_retain_sz);
+    if (g_heap)
+        g_heap->idle_since = now_ms();
+}
 
+/* -- heap_trim_idle -- */
+// Frees g_heap if it's been idle for at least g_retain_ms.
+static void heap_trim_idle() {
+    if (g_heap && !g_heap->stats.alloc_count &&
+        now_ms() - g_heap->idle_since >= g_retain_ms)
+        heap_free();
+}
+
+
+/* -- heap_keep_sz -- */
+// Returns: The num of bytes the heap keeps mapped while blocks are allocated -
+//      g_retain_sz, or enough for the background thread's prediction of
+//      demand, whichever is more.
+static size_t heap_keep_sz() {
+    size_t keep = g_heap->stats.mapped_sz - g_heap->stats.free_sz +
+                  2 * g_heap->ahead_sz;
+    return keep > g_retain_sz ? keep : g_retain_sz;
+}
+
+/* -- heap_ahead -- */
+// Updates the heap's prediction of demand from how much alloc_sz grew since
+//      the last call, and expands it if it has fewer free bytes than that.
+// Returns: The free block the heap was expanded with, or NULL if it wasn't.
+static BlockHead *heap_ahead() {
+    if (!g_heap || !g_heap->stats.alloc_count)
+        return NULL;
+
+    // Keep ahead of the last few ticks' growth, letting that decay by half
+    // per tick once growth slows
+    size_t alloc_sz = g_heap->stats.alloc_sz;
+    size_t ahead = alloc_sz > g_heap->ahead_base ?
+                   (alloc_sz - g_heap->ahead_base) * AHEAD_TICKS : 0;
+    if (ahead < g_heap->ahead_sz / 2)
+        ahead = g_heap->ahead_sz / 2;
+    g_heap->ahead_sz = ahead < GROW_MAX_SZ ? ahead : GROW_MAX_SZ;
+    g_heap->ahead_base = alloc_sz;
+
+    if (g_heap->stats.free_sz >= g_heap->ahead_sz)
+        return NULL;
+    return heap_expand(g_heap->ahead_sz - g_heap->stats.free_sz);
 }
 
-/* -- heap_squeeze -- */
-// Combines the heap's free contiguous memory blocks
-static void heap_squeeze() {
-    if (!g_heap->first_free)
+/* -- heap_prefault -- */
+// Faults in the whole pages in the given range of the heap ahead of use. May
+//      run w/o the arena's lock, in which case they may be allocated,
+//      or even unmapped, by the time it does - neither of which harms
+//      anything, as prefaulting never changes what mem holds.
+static void heap_prefault(char *start, size_t size) {
+    char *end = (char*)(((size_t)start + size) & ~(size_t)(PAGE_SZ - 1));
+    start = (char*)(((size_t)start + PAGE_SZ - 1) & ~(size_t)(PAGE_SZ - 1));
+    if (end <= start)
         return;
 
-    BlockHead *curr = g_heap->first_free;
-    while(curr) {
-        if (((char*)curr + curr->size) == (char*)curr->next)  {
-            curr->size += curr->next->size;
-            curr->next = curr->next->next;
-            if (curr->next)
-                curr->next->prev = curr;
-            continue;
-        }
-        curr = curr->next;
-    }
+#ifdef MADV_POPULATE_WRITE
+    if (!madvise(start, (size_t)(end - start), MADV_POPULATE_WRITE))
+        return;
+#endif
+    madvise(start, (size_t)(end - start), MADV_WILLNEED);
 }
 
 
@@ -315,160 +1401,1325 @@ static void heap_squeeze() {
 /* Begin Linked List Helpers --------------------------------------------DF */
 
 
-/* -- block_findfree -- */
-// Searches for a mem block >= "size" bytes in the given heap's "free" list.
-// Returns: On success, a ptr to the block found, else NULL;
-static void *block_findfree(size_t size) {
-    BlockHead *curr = g_heap->first_free;
+/* -- bin_index -- */
+// Returns: The index of the size class list that blocks of "size" bytes go in.
+// Assumes: size < TREE_MIN_SZ.
+static size_t bin_index(size_t size) {
+    return size / BIN_STEP;
+}
 
-    // Find and return the first free mem block of at least the given size
-    while (curr)
-        if (curr->size >= size)
-            return curr;
-        else
-            curr = curr->next;
+/* -- tree_index -- */
+// Returns: The index of the size class tree that blocks of "size" bytes go in.
+// Assumes: size >= TREE_MIN_SZ.
+static size_t tree_index(size_t size) {
+    // Split each power of two into 2^TREE_SUB_BITS classes
+    size_t log2_sz = BINMAP_BITS - 1 - __builtin_clzl(size);
+    size_t sub = (size >> (log2_sz - TREE_SUB_BITS)) &
+                 ((1 << TREE_SUB_BITS) - 1);
+    size_t idx = sub + ((log2_sz - TREE_SHIFT) << TREE_SUB_BITS);
+
+    // The last class holds every size too large for the others
+    if (idx >= TREE_COUNT)
+        idx = TREE_COUNT - 1;
+    return idx;
+}
 
-    // Else, if no free block found, expand the heap to get one
-    return heap_expand(size);
+/* -- tree_priority -- */
+// Returns: The given block's treap priority, a hash of its address.
+static size_t tree_priority(BlockHead *block) {
+    return ((size_t)block >> 4) * 0x9E3779B97F4A7C15UL;
 }
 
-/* -- block_add_tofree -- */
-// Adds the given block into the heap's "free" list.
-// Assumes: Block is valid and does not already exist in the "free" list.
-static void block_add_tofree(BlockHead *block) {
-    // If free list is empty, set us as first and return
-    if (!g_heap->first_free) {
-        g_heap->first_free = block;
-        return;
+/* -- tree_before -- */
+// Returns: Nonzero iff block "a" comes before block "b" in the tree - i.e.,
+//      it's smaller, or the same size and at a lower address, or under the
+//      first and next fit policies, just at a lower address.
+static int tree_before(BlockHead *a, BlockHead *b) {
+    if (g_fit != FIT_BEST)
+        return a < b;
+    return block_size(a) < block_size(b) ||
+           (block_size(a) == block_size(b) && a < b);
+}
+
+/* -- tree_insert -- */
+// Inserts the given free block into its size class tree.
+static void tree_insert(BlockHead *block) {
+    size_t idx = tree_index(block_size(block));
+    size_t priority = tree_priority(block);
+    g_heap->treemap[idx / BINMAP_BITS] |= (size_t)1 << (idx % BINMAP_BITS);
+
+    // Descend to where the block's priority puts it
+    BlockHead **link = &g_heap->trees[idx];
+    while (*link && tree_priority(*link) > priority)
+        link = tree_before(block, *link) ? &(*link)->left : &(*link)->right;
+
+    // Split the subtree there into the blocks before and after this one, which
+    // become its own subtrees
+    BlockHead *rest = *link;
+    BlockHead **left = &block->left;
+    BlockHead **right = &block->right;
+    while (rest) {
+        if (tree_before(rest, block)) {
+            *left = rest;
+            left = &rest->right;
+            rest = rest->right;
+        } else {
+            *right = rest;
+            right = &rest->left;
+            rest = rest->left;
+        }
     }
+    *left = NULL;
+    *right = NULL;
+    *link = block;
+}
 
-    // Else, find list insertion point (recall: list is sorted ASC by address)
-    BlockHead *curr = g_heap->first_free;
-    while (curr)
-        if (curr > block)
-            break;
-        else
-            curr = curr->next;
-       
-    // If no smaller addr found, assume head smaller and insert right after it
-    if (!curr) { 
-        block->prev = g_heap->first_free;
-        g_heap->first_free->next = block;
-    }
-    // Else if inserting ourselves before all other blocks
-    else if (curr == g_heap->first_free) {
-        block->next = curr;
-        curr->prev = block;
-        g_heap->first_free = block;
-    }
-    // Else, insert ourselves immediately before the curr block
-    else {
-        if (curr->prev)
-            curr->prev->next = block;
-        block->prev = curr->prev;
-        block->next = curr;
-        curr->prev = block;
+/* -- tree_remove -- */
+// Removes the given free block from its size class tree.
+// Assumes: The block's size hasn't changed since it was inserted.
+static void tree_remove(BlockHead *block) {
+    size_t idx = tree_index(block_size(block));
+    BlockHead **link = &g_heap->trees[idx];
+    while (*link != block)
+        link = tree_before(block, *link) ? &(*link)->left : &(*link)->right;
+
+    // Replace it w/its subtrees joined, the higher priority root on top
+    BlockHead *left = block->left;
+    BlockHead *right = block->right;
+    while (left && right) {
+        if (tree_priority(left) > tree_priority(right)) {
+            *link = left;
+            link = &left->right;
+            left = left->right;
+        } else {
+            *link = right;
+            link = &right->left;
+            right = right->left;
+        }
+    }
+    *link = left ? left : right;
 
+    // If the class is now empty, clear its bit
+    if (!g_heap->trees[idx])
+        g_heap->treemap[idx / BINMAP_BITS] &=
+            ~((size_t)1 << (idx % BINMAP_BITS));
+}
+
+/* -- tree_first -- */
+// Returns: The lowest-addressed block >= "size" bytes at or past "from" in the
+//      given subtree of an address-ordered tree, or NULL if there's none.
+static BlockHead *tree_first(BlockHead *node, char *from, size_t size) {
+    while (node) {
+        if ((char*)node >= from) {
+            BlockHead *found = tree_first(node->left, from, size);
+            if (found)
+                return found;
+            if (block_size(node) >= size)
+                return node;
+        }
+        node = node->right;
     }
-    
-    heap_squeeze();  // Combine any contiguous free blocks
+    return NULL;
 }
 
-/* -- block_rm_fromfree */
-// Removes the given block from the heap's "free" list.
-static void block_rm_fromfree(BlockHead *block) {
-    BlockHead *next = block->next;
-    BlockHead *prev = block->prev;
+/* -- tree_fit -- */
+// Returns: The block >= "size" bytes that the fit policy takes from the given
+//      class's tree, or NULL if there's none.
+static BlockHead *tree_fit(size_t idx, size_t size) {
+    BlockHead *root = g_heap->trees[idx];
+    if (g_fit == FIT_BEST) {
+        BlockHead *best = NULL;
+        for (BlockHead *node = root; node; ) {
+            if (block_size(node) >= size) {
+                best = node;
+                node = node->left;
+            } else {
+                node = node->right;
+            }
+        }
+        return best;
+    }
 
-    // If not at EOL, next node's "prev" becomes the node before us
-    if (next)
-        next->prev = prev;
+    // Else, search by address, from the rover on if next fit, then wrapping
+    BlockHead *found = NULL;
+    if (g_fit == FIT_NEXT)
+        found = tree_first(root, g_heap->rover, size);
+    if (!found)
+        found = tree_first(root, NULL, size);
+    if (found && g_fit == FIT_NEXT)
+        g_heap->rover = (char*)found;
+    return found;
+}
 
-    // If we're the head of the list, the next node becomes the new head
-    if (block == g_heap->first_free) {
-        if (next)
-            next->prev = NULL;
-        g_heap->first_free = next;
+/* -- tree_find -- */
+// Returns: The free block in the trees >= "size" bytes that the fit policy
+//      takes, or NULL if there's none.
+static BlockHead *tree_find(size_t size) {
+    // Search the size's own class, unless it's smaller than them all
+    size_t idx = 0;
+    if (size >= TREE_MIN_SZ) {
+        idx = tree_index(size);
+        BlockHead *found = g_heap->trees[idx] ? tree_fit(idx, size) : NULL;
+        if (found)
+            return found;
+        idx++;
     }
-    // Else, the prev node gets linked to the node ahead of us
-    else if (prev && prev->next) {
-        prev->next = next;
 
+    // Else, every block of the next non-empty class fits
+    for (size_t i = idx; i < TREE_COUNT; i = (i | (BINMAP_BITS - 1)) + 1) {
+        size_t bits = g_heap->treemap[i / BINMAP_BITS] >> (i % BINMAP_BITS);
+        if (bits)
+            return tree_fit(i + __builtin_ctzl(bits), 0);
     }
-
-    // Clear linked list info - it's no longer relevent
-    block->prev = NULL;
-    block->next = NULL;
+    return NULL;
 }
 
+/* -- list_insert -- */
+// Pushes the given free block onto the head of its size class list, in place
+//      of its tree under the lifo and tlsf fit policies.
+static void list_insert(BlockHead *block) {
+    size_t idx = tree_index(block_size(block));
 
-/* End Linked List Helpers ----------------------------------------------DF */
-/* Begin do_malloc, do_calloc, do_realloc, do_free ----------------------DF */
+    block->prev = NULL;
+    block->next = g_heap->trees[idx];
+    if (block->next)
+        block->next->prev = block;
 
+    g_heap->trees[idx] = block;
+    g_heap->treemap[idx / BINMAP_BITS] |= (size_t)1 << (idx % BINMAP_BITS);
+}
 
-/* -- do_malloc -- */
-// Allocates "size" bytes of memory to the requester.
-// RETURNS: A ptr to the allocated memory location on success, else NULL.
-static void *do_malloc(size_t size) {
-    if (!size)
-        return NULL;
+/* -- list_remove -- */
+// Removes the given free block from its size class list, in place of its tree
+//      under the lifo and tlsf fit policies.
+// Assumes: The block's size hasn't changed since it was inserted.
+static void list_remove(BlockHead *block) {
+    size_t idx = tree_index(block_size(block));
+
+    if (block->next)
+        block->next->prev = block->prev;
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        g_heap->trees[idx] = block->next;
+
+    if (!g_heap->trees[idx])
+        g_heap->treemap[idx / BINMAP_BITS] &=
+            ~((size_t)1 << (idx % BINMAP_BITS));
+}
 
-    // If heap not yet initialized, do it now
-    if (!g_heap) 
-        heap_init();
+/* -- list_find -- */
+// Returns: The free block >= "size" bytes that the fit policy takes from the
+//      size class lists that stand in for the trees, or NULL if there's none.
+//      Under tlsf, takes the head of the size's own class if it's large
+//      enough, else the head of the next non-empty class, every block of which
+//      is - both in O(1). Under lifo, searches the size's own class first.
+static BlockHead *list_find(size_t size) {
+    size_t idx = 0;
+    if (size >= TREE_MIN_SZ) {
+        idx = tree_index(size);
+        for (BlockHead *node = g_heap->trees[idx]; node; node = node->next) {
+            if (block_size(node) >= size)
+                return node;
+            if (g_fit == FIT_TLSF)
+                break;
+        }
+        idx++;
+    }
 
-    // Make room for block header
-    size += BLOCK_HEAD_SZ;
+    // Under tlsf, the last class is unbounded, so its head may be too small -
+    // searching it would take O(n), so such requests fail instead
+    for (size_t i = idx; i < TREE_COUNT; i = (i | (BINMAP_BITS - 1)) + 1) {
+        size_t bits = g_heap->treemap[i / BINMAP_BITS] >> (i % BINMAP_BITS);
+        if (bits)
+            return g_heap->trees[i + __builtin_ctzl(bits)];
+    }
+    return NULL;
+}
 
-    // Find a free block >= needed size (expands heap as needed)
-    BlockHead *free_block = block_findfree(size);
+/* -- bin_insert -- */
+// Pushes the given free block onto the head of its size class list, or into
+//      its size class tree if it's too large for those.
+static void bin_insert(BlockHead *block) {
+    g_heap->stats.free_sz += block_size(block);
+    g_heap->stats.free_count++;
 
-    if (!free_block)
-        return NULL;
+    if (block_size(block) >= TREE_MIN_SZ) {
+        if (FIT_LISTS(g_fit))
+            list_insert(block);
+        else
+            tree_insert(block);
+        return;
+    }
 
-    // Break up this block if it's larger than needed
-    if (size < free_block->size)
-        free_block = block_chunk(free_block, size);
+    size_t idx = bin_index(block_size(block));
 
-    // Remove block from the "free" list and return ptr to its data field
-    block_rm_fromfree(free_block);
+    block->prev = NULL;
+    block->next = g_heap->bins[idx];
+    if (block->next)
+        block->next->prev = block;
 
-    return free_block->data_addr;
+    g_heap->bins[idx] = block;
+    g_heap->binmap[idx / BINMAP_BITS] |= (size_t)1 << (idx % BINMAP_BITS);
 }
 
-/* -- do_calloc -- */
-// Allocates an array of "nmemb" elements of "size" bytes, w/each set to 0
-// RETURNS: A ptr to the mem addr on success, else NULL.
-static void *do_calloc(size_t nmemb, size_t size) {
-    // Ensure product of two sizes does not overflow a size_t
-    size_t total_sz = sizet_multiply(nmemb, size);
+/* -- bin_remove -- */
+// Removes the given free block from its size class list or tree.
+// Assumes: The block's size hasn't changed since it was inserted.
+static void bin_remove(BlockHead *block) {
+    if (block_size(block) >= TREE_MIN_SZ && FIT_LISTS(g_fit)) {
+        list_remove(block);
+    } else if (block_size(block) >= TREE_MIN_SZ) {
+        tree_remove(block);
+    } else {
+        size_t idx = bin_index(block_size(block));
 
-    if (total_sz)
-        return mem_set(do_malloc(total_sz), 0, total_sz);
+        if (block->next)
+            block->next->prev = block->prev;
+        if (block->prev)
+            block->prev->next = block->next;
+        else
+            g_heap->bins[idx] = block->next;
+
+        // If the class is now empty, clear its bit
+        if (!g_heap->bins[idx])
+            g_heap->binmap[idx / BINMAP_BITS] &=
+                ~((size_t)1 << (idx % BINMAP_BITS));
+    }
+
+    // Clear linked list info - it's no longer relevent
+    block->prev = NULL;
+    block->next = NULL;
+    block_undirty(block);
+
+    g_heap->stats.free_sz -= block_size(block);
+    g_heap->stats.free_count--;
+}
+
+/* -- bin_find -- */
+// Searches the size class lists and trees for a free block >= "size" bytes,
+//      the smallest of the lists' or, failing that, the trees' per the fit
+//      policy.
+// Returns: On success, a ptr to the block found, else NULL.
+static BlockHead *bin_find(size_t size) {
+    if (size >= TREE_MIN_SZ)
+        return FIT_LISTS(g_fit) ? list_find(size) : tree_find(size);
+
+    // Each class holds blocks of one size, so the next non-empty class at or
+    // above the size's own holds the best fit - find its bit in the bitmap.
+    for (size_t i = bin_index(size); i < BIN_COUNT;
+         i = (i | (BINMAP_BITS - 1)) + 1) {
+        size_t bits = g_heap->binmap[i / BINMAP_BITS] >> (i % BINMAP_BITS);
+        if (bits)
+            return g_heap->bins[i + __builtin_ctzl(bits)];
+    }
+
+    // Else, search the trees
+    return FIT_LISTS(g_fit) ? list_find(size) : tree_find(size);
+}
+
+/* -- block_findfree -- */
+// Searches for a mem block >= "size" bytes in the given heap's "free" lists.
+// Returns: On success, a ptr to the block found, else NULL;
+static void *block_findfree(size_t size) {
+    BlockHead *block = bin_find(size);
+    if (block || g_pool_sz)
+        return block;
+
+    // Else, if no free block found, expand the heap to get one
+    return heap_expand(size);
+}
+
+/* -- block_mergezero -- */
+// Decides if the block made by merging the given blocks, physically adjacent
+//      in the order given, can be BLOCK_ZEROED. If so, clears the words of
+//      theirs that end up inside it, scrubbing a dirty one if small enough.
+// Returns: BLOCK_ZEROED if the merged block is zeroed, else 0.
+static size_t block_mergezero(BlockHead *first, size_t first_zeroed,
+                              BlockHead *second, size_t second_zeroed) {
+    size_t first_sz = block_size(first);
+    size_t second_sz = block_size(second);
+
+    if (!first_zeroed && !second_zeroed)
+        return 0;
+    if ((!first_zeroed && first_sz > ZERO_SCRUB_MAX) ||
+        (!second_zeroed && second_sz > ZERO_SCRUB_MAX))
+        return 0;
+
+    if (!first_zeroed)
+        mem_set(block_getdata(first), 0, first_sz - BLOCK_HEAD_SZ);
+    if (!second_zeroed)
+        mem_set(second, 0, second_sz);
+
+    // The first's footer, and the second's header and links
+    mem_set((char*)second - WORD_SZ, 0, WORD_SZ + sizeof(BlockHead));
+    return BLOCK_ZEROED;
+}
+
+/* -- block_add_tofree -- */
+// Adds the given block into the heap's "free" lists, first combining it with
+// its physical neighbors if they're free. Their boundary tags make this O(1).
+// Assumes: Block is valid, allocated, and not in the "free" lists. It is
+// BLOCK_ZEROED only if split from one that was.
+// Returns: A ptr to the free block that the given one ended up part of.
+static BlockHead *block_add_tofree(BlockHead *block) {
+    size_t size = block_size(block);
+    size_t zeroed = block->size & BLOCK_ZEROED;
+
+    // Absorb the next block if it's free
+    BlockHead *next = block_next(block);
+    if (!(next->size & BLOCK_USED)) {
+        size_t next_sz = block_size(next);
+        bin_remove(next);
+        zeroed = block_mergezero(block, zeroed, next,
+                                 next->size & BLOCK_ZEROED);
+        size += next_sz;
+    }
+
+    // Be absorbed by the previous block if it's free
+    if (!(block->size & BLOCK_PREV_USED)) {
+        BlockHead *prev = block_prev(block);
+        bin_remove(prev);
+        block->size = size | (block->size & BLOCK_FLAGS);
+        zeroed = block_mergezero(prev, prev->size & BLOCK_ZEROED, block,
+                                 zeroed);
+        size += block_size(prev);
+        block = prev;
+    }
+
+    block_setfree(block, size);
+    block->size |= zeroed;
+    bin_insert(block);
+    block_dirty(block);
+
+    return block;
+}
+
+/* -- block_rm_fromfree */
+// Removes the given block from the heap's "free" lists and marks it allocated.
+static void block_rm_fromfree(BlockHead *block) {
+    bin_remove(block);
+    block_setused(block);
+}
+
+
+/* End Linked List Helpers ----------------------------------------------DF */
+/* Begin Purge Helpers ---------------------------------------------------- */
+
+
+/* -- block_tag -- */
+// Returns: A ptr to the given free block's decay tag, just after its links.
+// Assumes: The block is at least PURGE_MIN_SZ bytes.
+static DecayTag *block_tag(BlockHead *block) {
+    return (DecayTag*)((char*)block + sizeof(BlockHead));
+}
+
+/* -- block_dirty -- */
+// Stamps the given free block w/the current time, if it's big enough to purge
+//      and isn't zeroed, and queues it at the tail of the decay list.
+// Assumes: The block isn't on the decay list.
+static void block_dirty(BlockHead *block) {
+    if (g_pool_sz || block->size & BLOCK_ZEROED ||
+        block_size(block) < PURGE_MIN_SZ)
+        return;
+
+    DecayTag *tag = block_tag(block);
+    tag->stamp = now_ms();
+    tag->next = NULL;
+    tag->prev = g_heap->decay_tail;
+    if (tag->prev)
+        block_tag(tag->prev)->next = block;
+    else
+        g_heap->decay_head = block;
+    g_heap->decay_tail = block;
+
+    if (!g_heap->purge_due)
+        g_heap->purge_due = tag->stamp + g_decay_ms;
+}
+
+/* -- block_undirty -- */
+// Takes the given free block off the decay list, if it's on it, and clears
+//      its stamp.
+static void block_undirty(BlockHead *block) {
+    if (g_pool_sz || block->size & BLOCK_ZEROED ||
+        block_size(block) < PURGE_MIN_SZ)
+        return;
+
+    DecayTag *tag = block_tag(block);
+    if (!tag->stamp)
+        return;
+
+    if (tag->next)
+        block_tag(tag->next)->prev = tag->prev;
+    else
+        g_heap->decay_tail = tag->prev;
+    if (tag->prev)
+        block_tag(tag->prev)->next = tag->next;
+    else
+        g_heap->decay_head = tag->next;
+    tag->stamp = 0;
+}
+
+/* -- block_purge -- */
+// Gives the whole pages inside the given free block back to the kernel. After
+//      MADV_DONTNEED they read as zero, so the rest of the block is cleared
+//      too and it's flagged BLOCK_ZEROED. After MADV_FREE they may not, so it
+//      stays dirty, unstamped. If madvise fails, it's stamped anew.
+// Assumes: The block isn't on the decay list.
+static void block_purge(BlockHead *block) {
+    char *start = (char*)block_tag(block);
+    char *end = (char*)block + block_size(block) - WORD_SZ;
+    char *pages = (char*)(((size_t)start + PAGE_SZ - 1) & ~(size_t)(PAGE_SZ - 1));
+    char *pages_end = (char*)((size_t)end & ~(size_t)(PAGE_SZ - 1));
+
+#ifdef MADV_FREE
+    if (g_purge_lazy) {
+        if (madvise(pages, (size_t)(pages_end - pages), MADV_FREE))
+            block_dirty(block);
+        return;
+    }
+#endif
+
+    if (madvise(pages, (size_t)(pages_end - pages), MADV_DONTNEED)) {
+        block_dirty(block);
+        return;
+    }
+    mem_set(start, 0, (size_t)(pages - start));
+    mem_set(pages_end, 0, (size_t)(end - pages_end));
+    block->size |= BLOCK_ZEROED;
+}
+
+/* -- heap_purge -- */
+// Purges the stamped free blocks that have been free for at least g_decay_ms
+//      as of "now", oldest first and at most "max" of them, and notes when the
+//      next of the rest will be due.
+static void heap_purge(size_t now, size_t max) {
+    BlockHead *block;
+    for (size_t i = 0; i < max; i++) {
+        block = g_heap->decay_head;
+        if (!block || now - block_tag(block)->stamp < g_decay_ms)
+            break;
+        block_undirty(block);
+        block_purge(block);
+    }
+
+    block = g_heap->decay_head;
+    g_heap->purge_due = block ? block_tag(block)->stamp + g_decay_ms : 0;
+}
+
+/* -- heap_decay -- */
+// Purges up to "max" of the heap's decayed free blocks, if any are due.
+static void heap_decay(size_t max) {
+    if (!g_heap || !g_heap->purge_due)
+        return;
+
+    size_t now = now_ms();
+    if (now >= g_heap->purge_due)
+        heap_purge(now, max);
+}
+
+
+/* End Purge Helpers ------------------------------------------------------ */
+/* Begin Slab Helpers ----------------------------------------------------- */
+
+
+/* -- slab_owns -- */
+// Returns: Nonzero iff "ptr" points into a slab heap. Needs no lock, as the
+//      range reserved for them doesn't move once set, and slab_reserve
+//      publishes its start only after the rest.
+static int slab_owns(void *ptr) {
+    char *start = __atomic_load_n(&g_slab_start, __ATOMIC_ACQUIRE);
+    return start && (size_t)((char*)ptr - start) <
+                    (size_t)(g_slab_end - start);
+}
+
+/* -- slab_of -- */
+// Returns: A ptr to the slab heap whose share the given object is in.
+// Assumes: slab_owns(ptr).
+static SlabHeap *slab_of(void *ptr) {
+    return g_slabs + (size_t)((char*)ptr - g_slab_start) / g_slab_share;
+}
+
+/* -- slab_desc -- */
+// Returns: A ptr to the descriptor of the slab page the given object is in.
+static PageDesc *slab_desc(void *ptr) {
+    SlabHeap *slab = slab_of(ptr);
+    return slab->descs + (size_t)((char*)ptr - slab->start) / PAGE_SZ;
+}
+
+/* -- slab_page -- */
+// Returns: A ptr to the first byte of the page the given descriptor, of the
+//      held slab heap's, is for.
+static char *slab_page(PageDesc *desc) {
+    return g_slab->start + (size_t)(desc - g_slab->descs) * PAGE_SZ;
+}
+
+/* -- slab_lock -- */
+// Locks the given slab heap, making it g_slab.
+static void slab_lock(SlabHeap *slab) {
+    pthread_mutex_lock(&slab->lock);
+    g_slab = slab;
+}
+
+/* -- slab_unlock -- */
+// Unlocks the slab heap held.
+static void slab_unlock() {
+    SlabHeap *slab = g_slab;
+    g_slab = NULL;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+/* -- slab_reserve -- */
+// Reserves the addresses slabs and spans are carved from, and those of their
+//      page map, and splits them between the slab heaps. Sets g_slab_failed
+//      if they can't be reserved.
+// Assumes: The num of arenas is settled.
+static void slab_reserve() {
+    size_t count = g_arena_count;
+    size_t share = g_slab_reserve_sz / count / SLAB_COMMIT_SZ * SLAB_COMMIT_SZ;
+    if (!share) {
+        count = g_slab_reserve_sz / SLAB_COMMIT_SZ;
+        share = SLAB_COMMIT_SZ;
+    }
+
+    // Each heap's slice of the page map starts on a page of its own, so no
+    // two heaps ever commit the same one
+    size_t descs_sz = (share / PAGE_SZ * sizeof(PageDesc) + PAGE_SZ - 1) &
+                      ~(size_t)(PAGE_SZ - 1);
+    char *start = do_reserve(count * share);
+    char *descs = start ? do_reserve(count * descs_sz) : NULL;
+    if (!descs) {
+        if (start)
+            do_munmap(start, count * share);
+        g_slab_failed = 1;
+        return;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        SlabHeap *slab = g_slabs + i;
+        slab->start = slab->top = slab->commit_end = start + i * share;
+        slab->end = slab->start + share;
+        slab->descs = (PageDesc*)(descs + i * descs_sz);
+        slab->descs_end = descs + i * descs_sz;
+    }
+
+    // Set the start last, as slab_owns reads it, w/o a lock, to tell whether
+    // the rest is set
+    g_slab_count = count;
+    g_slab_share = share;
+    g_slab_end = start + count * share;
+    __atomic_store_n(&g_slab_start, start, __ATOMIC_RELEASE);
+    bg_want();
+}
+
+/* -- slab_init -- */
+// Reserves the addresses of the slab heaps, at first use.
+// Assumes: An arena is held, so the num of arenas is settled.
+// Returns: Nonzero if they're reserved, else 0 (and slabs aren't used).
+static int slab_init() {
+    if (g_slab_start)
+        return 1;
+    config_init();
+    if (g_pool_sz || g_slab_failed || g_slab_reserve_sz < SLAB_COMMIT_SZ)
+        return 0;
+
+    pthread_once(&slab_once, slab_reserve);
+    return g_slab_start != NULL;
+}
+
+/* -- slab_commit -- */
+// Commits the next SLAB_COMMIT_SZ bytes of the held slab heap's share, and as
+//      much of its page map as describes them.
+// Returns: Nonzero on success, else 0.
+static int slab_commit() {
+    if (g_slab->commit_end == g_slab->end)
+        return 0;
+
+    size_t pages = (size_t)(g_slab->commit_end - g_slab->start) / PAGE_SZ +
+                   SLAB_COMMIT_SZ / PAGE_SZ;
+    char *descs_end = (char*)(((size_t)(g_slab->descs + pages) + PAGE_SZ - 1) &
+                              ~(size_t)(PAGE_SZ - 1));
+    if (descs_end > g_slab->descs_end) {
+        if (do_commit(g_slab->descs_end,
+                      (size_t)(descs_end - g_slab->descs_end)))
+            return 0;
+        g_slab->descs_end = descs_end;
+    }
+
+    if (do_commit(g_slab->commit_end, SLAB_COMMIT_SZ))
+        return 0;
+    g_slab->commit_end += SLAB_COMMIT_SZ;
+    return 1;
+}
+
+/* -- slab_link -- */
+// Adds the given slab to the head of its class's list of slabs w/free slots.
+static void slab_link(PageDesc *slab) {
+    PageDesc **bin = &g_slab->bins[slab->slot_sz / ALIGN_SZ - 1];
+    slab->prev = NULL;
+    slab->next = *bin;
+    if (slab->next)
+        slab->next->prev = slab;
+    *bin = slab;
+}
+
+/* -- slab_unlink -- */
+// Removes the given slab from its class's list of slabs w/free slots.
+static void slab_unlink(PageDesc *slab) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        g_slab->bins[slab->slot_sz / ALIGN_SZ - 1] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+/* -- slab_new -- */
+// Makes a slab w/slots of "slot_sz" bytes, all free, from an empty slab, a
+//      purged one, or the next unused page, committing more pages as needed.
+// Returns: A ptr to the new slab's descriptor on success, else NULL.
+static PageDesc *slab_new(size_t slot_sz) {
+    PageDesc *slab = g_slab->empty;
+    if (slab) {
+        g_slab->empty = slab->next;
+        g_slab->empty_count--;
+    } else if ((slab = g_slab->purged)) {
+        g_slab->purged = slab->next;
+        g_slab->purged_count--;
+    } else {
+        if (g_slab->top == g_slab->commit_end && !slab_commit())
+            return NULL;
+        slab = slab_desc(g_slab->top);
+        g_slab->top += PAGE_SZ;
+        g_slab->slab_pages++;
+    }
+
+    // Mark each slot free, and none of the bits past the last one
+    size_t slots = PAGE_SZ / slot_sz;
+    slab->slot_sz = slot_sz;
+    slab->slots = slots;
+    slab->used = 0;
+    for (size_t i = 0; i < SLAB_MAP_WORDS; i++) {
+        size_t bits = slots > BINMAP_BITS ? BINMAP_BITS : slots;
+        slab->freemap[i] = bits == BINMAP_BITS ? (size_t)-1 :
+                           ((size_t)1 << bits) - 1;
+        slots -= bits;
+    }
+
+    slab_link(slab);
+    return slab;
+}
+
+/* -- slab_alloc -- */
+// Allocates an object of "size" bytes from a slab of its class.
+// Assumes: 0 < size <= SLAB_MAX_SZ.
+// Returns: A ptr to the object on success, else NULL.
+static void *slab_alloc(size_t size) {
+    size_t cls = (size - 1) / ALIGN_SZ;
+    PageDesc *slab = g_slab->bins[cls];
+    if (!slab)
+        slab = slab_new((cls + 1) * ALIGN_SZ);
+    if (!slab)
+        return NULL;
+
+    // Take the first free slot, dropping the slab from its list once full
+    size_t i = 0;
+    while (!slab->freemap[i])
+        i++;
+    size_t bit = (size_t)__builtin_ctzl(slab->freemap[i]);
+    slab->freemap[i] &= ~((size_t)1 << bit);
+    if (++slab->used == slab->slots)
+        slab_unlink(slab);
+    g_slab->obj_count++;
+
+    return slab_page(slab) + (i * BINMAP_BITS + bit) * slab->slot_sz;
+}
+
+/* -- slab_free -- */
+// Frees the given slab object. A slab that was full goes back on its class's
+//      list, and one left w/no objects goes on the "empty" list, or if that
+//      has SLAB_EMPTY_MAX slabs already, has its page given back to the
+//      kernel and goes on the "purged" list.
+static void slab_free(void *ptr) {
+    PageDesc *slab = slab_desc(ptr);
+    size_t slot = (size_t)((char*)ptr - slab_page(slab)) / slab->slot_sz;
+
+    slab->freemap[slot / BINMAP_BITS] |= (size_t)1 << (slot % BINMAP_BITS);
+    if (slab->used-- == slab->slots)
+        slab_link(slab);
+    g_slab->obj_count--;
+
+    if (slab->used)
+        return;
+
+    slab_unlink(slab);
+    if (g_slab->empty_count < SLAB_EMPTY_MAX ||
+        madvise(slab_page(slab), PAGE_SZ, MADV_DONTNEED)) {
+        slab->next = g_slab->empty;
+        g_slab->empty = slab;
+        g_slab->empty_count++;
+    } else {
+        slab->next = g_slab->purged;
+        g_slab->purged = slab;
+        g_slab->purged_count++;
+    }
+}
+
+
+/* End Slab Helpers ------------------------------------------------------- */
+/* Begin Span Helpers ----------------------------------------------------- */
+
+
+/* -- span_wanted -- */
+// Returns: Nonzero iff a request of "size" bytes is served from a span. Needs
+//      no lock, as what it reads doesn't change once the heap's in use.
+static int span_wanted(size_t size) {
+    if (size < SPAN_MIN_SZ || size > SPAN_MAX_SZ || g_pool_sz ||
+        g_slab_failed || g_slab_reserve_sz < SLAB_COMMIT_SZ)
+        return 0;
+
+    size_t waste = (PAGE_SZ - size % PAGE_SZ) % PAGE_SZ;
+    return waste <= size >> SPAN_WASTE_SHIFT;
+}
+
+/* -- span_is -- */
+// Returns: Nonzero iff the given page descriptor is the first or last of a
+//      span's, rather than a slab's.
+static int span_is(PageDesc *desc) {
+    return desc->slot_sz >= PAGE_SZ;
+}
+
+/* -- span_set -- */
+// Describes the "pages" pages from the given descriptor's on as one span,
+//      allocated if "used" is nonzero, else free and all zero if "zero" is.
+static void span_set(PageDesc *span, size_t pages, size_t used, size_t zero) {
+    PageDesc *last = span + pages - 1;
+    span->slot_sz = last->slot_sz = pages * PAGE_SZ;
+    span->used = last->used = used;
+    span->slots = last->slots = zero;
+}
+
+/* -- span_bin -- */
+// Returns: The index of the free span list for spans of "pages" pages.
+static size_t span_bin(size_t pages) {
+    return (pages < SPAN_BINS ? pages : SPAN_BINS) - 1;
+}
+
+/* -- span_link -- */
+// Adds the given free span to the head of its page count's list.
+static void span_link(PageDesc *span) {
+    size_t idx = span_bin(span->slot_sz / PAGE_SZ);
+    span->prev = NULL;
+    span->next = g_slab->spans[idx];
+    if (span->next)
+        span->next->prev = span;
+    g_slab->spans[idx] = span;
+    g_slab->spanmap[idx / BINMAP_BITS] |= (size_t)1 << (idx % BINMAP_BITS);
+
+    if (!span->slots)
+        g_slab->span_dirty_sz += span->slot_sz;
+}
+
+/* -- span_unlink -- */
+// Removes the given free span from its page count's list.
+static void span_unlink(PageDesc *span) {
+    size_t idx = span_bin(span->slot_sz / PAGE_SZ);
+    if (span->prev)
+        span->prev->next = span->next;
+    else
+        g_slab->spans[idx] = span->next;
+    if (span->next)
+        span->next->prev = span->prev;
+
+    if (!g_slab->spans[idx])
+        g_slab->spanmap[idx / BINMAP_BITS] &=
+            ~((size_t)1 << (idx % BINMAP_BITS));
+    if (!span->slots)
+        g_slab->span_dirty_sz -= span->slot_sz;
+}
+
+/* -- span_find -- */
+// Returns: The free span w/the fewest pages >= "pages", or NULL if there's
+//      none. Only the last list, of every count past the others', is searched.
+static PageDesc *span_find(size_t pages) {
+    size_t idx = span_bin(pages);
+    if (idx == SPAN_BINS - 1) {
+        for (PageDesc *span = g_slab->spans[idx]; span; span = span->next)
+            if (span->slot_sz >= pages * PAGE_SZ)
+                return span;
+        return NULL;
+    }
+
+    for (size_t i = idx; i < SPAN_BINS; i = (i | (BINMAP_BITS - 1)) + 1) {
+        size_t bits = g_slab->spanmap[i / BINMAP_BITS] >> (i % BINMAP_BITS);
+        if (bits)
+            return g_slab->spans[i + __builtin_ctzl(bits)];
+    }
+    return NULL;
+}
+
+/* -- span_alloc -- */
+// Allocates a span of "size" bytes' worth of pages, from a free span - the
+//      rest of which stays free - or the next unused pages, committing more
+//      as needed. Sets "is_zero" nonzero iff the span is known to be all zero.
+// Assumes: span_wanted(size).
+// Returns: A ptr to the span's first page on success, else NULL.
+static void *span_alloc(size_t size, size_t *is_zero) {
+    size_t pages = (size + PAGE_SZ - 1) / PAGE_SZ;
+    PageDesc *span = span_find(pages);
+    *is_zero = 1;
+    if (span) {
+        span_unlink(span);
+        *is_zero = span->slots;
+        size_t span_pages = span->slot_sz / PAGE_SZ;
+        if (span_pages > pages) {
+            span_set(span + pages, span_pages - pages, 0, *is_zero);
+            span_link(span + pages);
+        }
+    } else {
+        while ((size_t)(g_slab->commit_end - g_slab->top) < pages * PAGE_SZ)
+            if (!slab_commit())
+                return NULL;
+        span = slab_desc(g_slab->top);
+        g_slab->top += pages * PAGE_SZ;
+    }
+
+    span_set(span, pages, 1, 0);
+    g_slab->span_sz += pages * PAGE_SZ;
+    g_slab->span_count++;
+    return slab_page(span);
+}
+
+/* -- span_free -- */
+// Frees the given span, merging it w/the free spans on either side of it. Its
+//      pages, and those of any it merges w/, are to be given back to the
+//      kernel if that leaves more free spans not known to be zero than are
+//      kept resident, or if one it merges w/is known to be, so that none of
+//      the merged span's pages is counted as dirty unless it is. If so, the
+//      merged span is left off the lists, still marked allocated so that no
+//      other span merges w/it, for the caller to pass to span_purge once it
+//      has dropped the slab heap's lock.
+// Returns: A ptr to the merged span's first page if it's to be purged, else
+//      NULL.
+static void *span_free(void *ptr) {
+    PageDesc *span = slab_desc(ptr);
+    size_t size = span->slot_sz;
+    g_slab->span_sz -= size;
+    g_slab->span_count--;
+
+    // Find the free spans on either side - the one before by the descriptor
+    // of its last page, the one after unless it's past the last span
+    PageDesc *prev = NULL;
+    if (span > g_slab->descs && span_is(span - 1) && !span[-1].used)
+        prev = span - span[-1].slot_sz / PAGE_SZ;
+    PageDesc *next = span + size / PAGE_SZ;
+    if (slab_page(next) >= g_slab->top || !span_is(next) || next->used)
+        next = NULL;
+
+    size_t keep = g_slab->span_sz >> SPAN_DIRTY_SHIFT;
+    if (keep < SPAN_DIRTY_MAX)
+        keep = SPAN_DIRTY_MAX;
+    int purge = g_slab->span_dirty_sz + size > keep ||
+                (prev && prev->slots) || (next && next->slots);
+
+    if (prev) {
+        span_unlink(prev);
+        size += prev->slot_sz;
+        span = prev;
+    }
+    if (next) {
+        span_unlink(next);
+        size += next->slot_sz;
+    }
+
+    span_set(span, size / PAGE_SZ, purge, 0);
+    if (purge)
+        return slab_page(span);
+    span_link(span);
     return NULL;
 }
 
+/* -- span_purge -- */
+// Gives the pages of the given span, left off the lists by span_free, back to
+//      the kernel, then frees it as a span known to be all zero, merging it
+//      w/any free span on either side of it that's known to be too. If the
+//      pages can't be given back, it's freed as it is, unmerged.
+// Assumes: No slab heap is held.
+static void span_purge(void *ptr) {
+    PageDesc *span = slab_desc(ptr);
+    size_t size = span->slot_sz;
+    size_t zero = !madvise(ptr, size, MADV_DONTNEED);
+
+    slab_lock(slab_of(ptr));
+    if (zero) {
+        if (span > g_slab->descs && span_is(span - 1) && !span[-1].used &&
+            span[-1].slots) {
+            span -= span[-1].slot_sz / PAGE_SZ;
+            span_unlink(span);
+            size += span->slot_sz;
+        }
+        PageDesc *next = span + size / PAGE_SZ;
+        if (slab_page(next) < g_slab->top && span_is(next) && !next->used &&
+            next->slots) {
+            span_unlink(next);
+            size += next->slot_sz;
+        }
+    }
+
+    span_set(span, size / PAGE_SZ, 0, zero);
+    span_link(span);
+    slab_unlock();
+}
+
+/* -- span_resize -- */
+// Resizes the given span in place to hold "size" bytes, giving back the pages
+//      past what it needs, or growing it into the free span after it. Sets
+//      "purge" as span_free returns it, for the pages given back.
+// Returns: 1 if the span now holds "size" bytes, else 0 (and it's unchanged).
+static int span_resize(void *ptr, size_t size, void **purge) {
+    if (!span_wanted(size))
+        return 0;
+
+    PageDesc *span = slab_desc(ptr);
+    size_t pages = span->slot_sz / PAGE_SZ;
+    size_t need = (size + PAGE_SZ - 1) / PAGE_SZ;
+
+    // Absorb the next span if it's free and makes enough room
+    if (need > pages) {
+        PageDesc *next = span + pages;
+        if (slab_page(next) >= g_slab->top || !span_is(next) || next->used ||
+            pages + next->slot_sz / PAGE_SZ < need)
+            return 0;
+
+        span_unlink(next);
+        g_slab->span_sz += next->slot_sz;
+        pages += next->slot_sz / PAGE_SZ;
+        span_set(span, pages, 1, 0);
+    }
+
+    // Give back any excess at the span's end, as a span of its own
+    if (pages > need) {
+        span_set(span, need, 1, 0);
+        span_set(span + need, pages - need, 1, 0);
+        g_slab->span_count++;
+        *purge = span_free(slab_page(span + need));
+    }
+    return 1;
+}
+
+/* -- page_alloc -- */
+// Allocates an object of "size" bytes from a slab, or a span, of the held
+//      arena's slab heap, under its lock. The object is zeroed if "zero" is
+//      nonzero, and it isn't known to be already, outside of the lock.
+// Assumes: size <= SLAB_MAX_SZ or span_wanted(size).
+// Returns: A ptr to the object on success, else NULL.
+static void *page_alloc(size_t size, int zero) {
+    if (!slab_init())
+        return NULL;
+
+    size_t is_zero = 0;
+    slab_lock(g_slabs + (size_t)(g_arena - g_arenas) % g_slab_count);
+    void *ptr = size <= SLAB_MAX_SZ ? slab_alloc(size) :
+                                      span_alloc(size, &is_zero);
+    slab_unlock();
+
+    if (ptr && zero && !is_zero)
+        mem_set(ptr, 0, size);
+    return ptr;
+}
+
+/* -- page_free -- */
+// Frees the given slab object or span, under its slab heap's lock. Pages
+//      given back to the kernel are given back after it's dropped.
+static void page_free(void *ptr) {
+    void *purge = NULL;
+    slab_lock(slab_of(ptr));
+    if (span_is(slab_desc(ptr)))
+        purge = span_free(ptr);
+    else
+        slab_free(ptr);
+    slab_unlock();
+
+    if (purge)
+        span_purge(purge);
+}
+
+/* -- page_resize -- */
+// Resizes the given span in place, as span_resize does, under its slab heap's
+//      lock. Pages given back to the kernel are given back after it's dropped.
+// Returns: 1 if the span now holds "size" bytes, else 0 (and it's unchanged).
+static int page_resize(void *ptr, size_t size) {
+    void *purge = NULL;
+    slab_lock(slab_of(ptr));
+    int resized = span_resize(ptr, size, &purge);
+    slab_unlock();
+
+    if (purge)
+        span_purge(purge);
+    return resized;
+}
+
+
+/* End Span Helpers ------------------------------------------------------- */
+/* Begin Huge Block Helpers ----------------------------------------------- */
+
+
+/* -- huge_wanted -- */
+// Returns: Nonzero iff a request of "size" bytes gets a mapping to itself.
+static int huge_wanted(size_t size) {
+    return size >= __atomic_load_n(&g_mmap_threshold, __ATOMIC_RELAXED);
+}
+
+/* -- huge_alloc -- */
+// Allocates "size" bytes of memory to the requester in a new mapping of its
+//      own. As it touches no heap state, this needs no lock.
+// RETURNS: A ptr to the allocated memory location on success, else NULL.
+static void *huge_alloc(size_t size) {
+    if (size > (size_t)-1 - MAP_PAD_SZ - BLOCK_HEAD_SZ - PAGE_SZ)
+        return NULL;
+
+    size_t map_sz = (size + MAP_PAD_SZ + BLOCK_HEAD_SZ + PAGE_SZ - 1) &
+                    ~(size_t)(PAGE_SZ - 1);
+    void *map = do_mmap(map_sz);
+    if (!map)
+        return NULL;
+
+    BlockHead *block = (BlockHead*)((char*)map + MAP_PAD_SZ);
+    block->size = map_sz | BLOCK_USED | BLOCK_MMAPPED;
+
+    __atomic_add_fetch(&g_huge_sz, map_sz, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&g_huge_count, 1, __ATOMIC_RELAXED);
+
+    return block_getdata(block);
+}
+
+/* -- huge_realloc -- */
+// Resizes the given mmapped block's mapping to hold "size" bytes, letting the
+//      kernel move its pages rather than copying them. As it touches no heap
+//      state, this needs no lock.
+// RETURNS: A ptr to the block's (possibly moved) data field on success, else
+//      NULL, in which case the block is unchanged.
+static void *huge_realloc(BlockHead *block, size_t size) {
+    if (size > (size_t)-1 - MAP_PAD_SZ - BLOCK_HEAD_SZ - PAGE_SZ)
+        return NULL;
+
+    size_t old_sz = block_size(block);
+    size_t map_sz = (size + MAP_PAD_SZ + BLOCK_HEAD_SZ + PAGE_SZ - 1) &
+                    ~(size_t)(PAGE_SZ - 1);
+    if (map_sz == old_sz)
+        return block_getdata(block);
+
+    void *map = mremap((char*)block - MAP_PAD_SZ, old_sz, map_sz,
+                       MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    block = (BlockHead*)((char*)map + MAP_PAD_SZ);
+    block->size = map_sz | BLOCK_USED | BLOCK_MMAPPED;
+
+    __atomic_add_fetch(&g_huge_sz, map_sz - old_sz, __ATOMIC_RELAXED);
+
+    return block_getdata(block);
+}
+
+/* -- huge_free -- */
+// Unmaps the given mmapped block, raising the mmap threshold to its size if
+//      the threshold is adaptive. As it touches no heap state, this needs no
+//      lock.
+static void huge_free(BlockHead *block) {
+    size_t map_sz = block_size(block);
+    size_t data_sz = block_datasize(block);
+
+    if (!__atomic_load_n(&g_mmap_threshold_fixed, __ATOMIC_RELAXED) &&
+        data_sz > __atomic_load_n(&g_mmap_threshold, __ATOMIC_RELAXED) &&
+        data_sz <= MMAP_THRESHOLD_MAX)
+        __atomic_store_n(&g_mmap_threshold, data_sz, __ATOMIC_RELAXED);
+
+    __atomic_sub_fetch(&g_huge_sz, map_sz, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&g_huge_count, 1, __ATOMIC_RELAXED);
+
+    do_munmap((char*)block - MAP_PAD_SZ, map_sz);
+}
+
+
+/* End Huge Block Helpers ------------------------------------------------- */
+/* Begin do_malloc, do_calloc, do_realloc, do_free ----------------------DF */
+
+
+/* -- block_alloc -- */
+// Allocates a block from the heap w/a data field of "size" bytes.
+// RETURNS: A ptr to the allocated block on success, else NULL. The block is
+//      still flagged BLOCK_ZEROED if it was, for the caller to clear.
+static BlockHead *block_alloc(size_t size) {
+    // If heap not yet initialized, do it now. It may fail to be, as when
+    // the arena's slot can't be committed.
+    if (!g_heap) 
+        heap_init();
+    if (!g_heap)
+        return NULL;
+
+    // Make room for block header, and for a footer once it's freed, keeping
+    // the size a multiple of ALIGN_SZ so the next block's data stays aligned
+    size = block_reqsize(size);
+    if (!size)
+        return NULL;
+
+    // Find a free block >= needed size (expands heap as needed)
+    BlockHead *free_block = block_findfree(size);
+
+    if (!free_block)
+        return NULL;
+
+    // Remove block from the "free" lists, then give back any excess. If the
+    // block is zeroed, so is the excess.
+    block_rm_fromfree(free_block);
+    block_chunk(free_block, size);
+
+    return free_block;
+}
+
+/* -- do_malloc -- */
+// Allocates "size" bytes of memory to the requester.
+// RETURNS: A ptr to the allocated memory location on success, else NULL.
+static void *do_malloc(size_t size) {
+    if (!size)
+        return NULL;
+
+    if (span_wanted(size)) {
+        void *ptr = page_alloc(size, 0);
+        if (ptr)
+            return ptr;
+    }
+
+    if (huge_wanted(size))
+        return huge_alloc(size);
+
+    if (size <= SLAB_MAX_SZ) {
+        void *ptr = page_alloc(size, 0);
+        if (ptr)
+            return ptr;
+    }
+
+    BlockHead *block = block_alloc(size);
+    if (!block)
+        return NULL;
+
+    block->size &= ~(size_t)BLOCK_ZEROED;
+    return block_getdata(block);
+}
+
+/* -- do_calloc -- */
+// Allocates an array of "nmemb" elements of "size" bytes, w/each set to 0
+// RETURNS: A ptr to the mem addr on success, else NULL.
+static void *do_calloc(size_t nmemb, size_t size) {
+    // Ensure product of two sizes does not overflow a size_t
+    size_t total_sz = sizet_multiply(nmemb, size);
+    if (!total_sz)
+        return NULL;
+
+    if (span_wanted(total_sz)) {
+        void *ptr = page_alloc(total_sz, 1);
+        if (ptr)
+            return ptr;
+    }
+
+    // Fresh mappings are already zeroed
+    if (huge_wanted(total_sz))
+        return huge_alloc(total_sz);
+
+    if (total_sz <= SLAB_MAX_SZ) {
+        void *ptr = page_alloc(total_sz, 1);
+        if (ptr)
+            return ptr;
+    }
+
+    BlockHead *block = block_alloc(total_sz);
+    if (!block)
+        return NULL;
+
+    void *ptr = block_getdata(block);
+    if (!(block->size & BLOCK_ZEROED)) {
+        mem_set(ptr, 0, total_sz);
+        return ptr;
+    }
+
+    // Only the old list links and footer may be nonzero
+    block->size &= ~(size_t)BLOCK_ZEROED;
+    mem_set(ptr, 0, total_sz < 2 * WORD_SZ ? total_sz : 2 * WORD_SZ);
+    mem_set((char*)block + block_size(block) - WORD_SZ, 0, WORD_SZ);
+    return ptr;
+}
+
 /* -- do_free -- */
 // Frees the memory space pointed to by ptr iff ptr != NULL
 static void do_free(void *ptr) {
     if (!ptr) 
         return;
 
-    // Get ptr to header and add to "free" list
-    block_add_tofree(block_getheader(ptr));
+    if (slab_owns(ptr)) {
+        page_free(ptr);
+        return;
+    }
+
+    // Get ptr to header and add to "free" list, unless it's not in the heap
+    BlockHead *block = block_getheader(ptr);
+    if (block->size & BLOCK_MMAPPED) {
+        huge_free(block);
+        return;
+    }
+
+    g_heap->stats.alloc_sz -= block_size(block);
+    g_heap->stats.alloc_count--;
+    block = block_add_tofree(block);
+
+    // A real-time pool keeps all its pages, and spends no time on upkeep
+    if (g_pool_sz)
+        return;
 
-    // Determine total size of all free memory blocks, for use below
-    size_t free_sz = 0;
-    BlockHead *curr = g_heap->first_free;
-    while(curr) {
-        free_sz += curr->size;
-        curr = curr->next ;
+    // If no blocks remain allocated, release what's beyond the retained part.
+    // Else, if over that, release the block's mapping if it's now all free,
+    // or the end of the first mapping if the block's there and large enough.
+    if (!g_heap->stats.alloc_count) {
+        heap_idle();
+    } else if (g_heap->stats.mapped_sz > heap_keep_sz()) {
+        SegHead *seg = seg_spanned(block);
+        if (seg)
+            seg_unmap(seg);
+        else
+            heap_trim_top(heap_keep_sz(), TRIM_MIN_SZ);
     }
 
-    // If total sz free == heap size, free the heap - it reinits as needed
-    if (free_sz == g_heap->size - HEAP_HEAD_SZ)
-        heap_free();
-    
+    if (!bg_running())
+        heap_decay(PURGE_BATCH);
+}
+
+/* -- block_resize -- */
+// Resizes the given allocated block in place to hold "size" bytes, shrinking
+//      it by splitting off its tail or growing it into the free block
+//      physically after it.
+// Assumes: The block is part of the heap, not mmapped on its own.
+// Returns: 1 if the block now holds "size" bytes, else 0 (and it's unchanged).
+static int block_resize(BlockHead *block, size_t size) {
+    size = block_reqsize(size);
+    if (!size)
+        return 0;
+
+    // Absorb the next block if it's free and makes enough room
+    if (size > block_size(block)) {
+        BlockHead *next = block_next(block);
+        size_t next_sz = block_size(next);
+        if (next->size & BLOCK_USED || block_size(block) + next_sz < size)
+            return 0;
+
+        bin_remove(next);
+        block->size += next_sz;
+        block_next(block)->size |= BLOCK_PREV_USED;
+        g_heap->stats.alloc_sz += next_sz;
+    }
+
+    // Give back any excess at the block's end
+    block_chunk(block, size);
+    return 1;
 }
 
 /* -- do_realloc -- */
@@ -485,13 +2736,35 @@ static void *do_realloc(void *ptr, size_t size) {
     if (!ptr)
         return do_malloc(size);
     
+    // Else, resize the block or span where it is if able. A slab object stays
+    // in its slot if it fits.
+    size_t old_sz = do_usable_size(ptr);
+    if (slab_owns(ptr) && span_is(slab_desc(ptr))) {
+        if (page_resize(ptr, size))
+            return ptr;
+    } else if (slab_owns(ptr)) {
+        if (size <= old_sz)
+            return ptr;
+    } else {
+        BlockHead *old_block = block_getheader(ptr);
+        if (old_block->size & BLOCK_MMAPPED) {
+            if (huge_wanted(size))
+                return huge_realloc(old_block, size);
+        } else if (block_resize(old_block, size)) {
+            return ptr;
+        }
+    }
+
     // Else, reallocate the mem location
     BlockHead *new_block = do_malloc(size);
-    BlockHead *old_block = block_getheader(ptr);
 
+    if (!new_block)
+        return NULL;
+
+    // Copy no more than the old data field holds
     size_t cpy_len = size;
-    if (size > old_block->size)
-        cpy_len = old_block->size;
+    if (size > old_sz)
+        cpy_len = old_sz;
 
     mem_cpy(new_block, ptr, cpy_len);
     do_free(ptr);
@@ -499,25 +2772,705 @@ static void *do_realloc(void *ptr, size_t size) {
     return new_block;
 }
 
+/* -- do_memalign -- */
+// Allocates "size" bytes of memory whose address is a multiple of "alignment".
+//      The excess in front of the aligned data field and behind it is split
+//      off and returned to the "free" lists, so none of it is wasted.
+// Assumes: "alignment" is a power of two.
+// RETURNS: A ptr to the allocated memory location on success, else NULL.
+static void *do_memalign(size_t alignment, size_t size) {
+    if (alignment <= ALIGN_SZ)
+        return do_malloc(size);
+
+    // Spans start on a page
+    if (alignment <= PAGE_SZ && span_wanted(size)) {
+        void *ptr = page_alloc(size, 0);
+        if (ptr)
+            return ptr;
+    }
+
+    if (!size)
+        return NULL;
+
+    if (!g_heap) 
+        heap_init();
+    if (!g_heap)
+        return NULL;
+
+    // Find a block w/room for the data field at any alignment, plus a
+    // leading remainder large enough to be a free block itself
+    size = block_reqsize(size);
+    if (!size || size > (size_t)-1 - START_HEAP_SZ - alignment)
+        return NULL;
+
+    BlockHead *block = block_findfree(size + alignment + MIN_BLOCK_SZ);
+    if (!block)
+        return NULL;
+    block_rm_fromfree(block);
+
+    // If the block's data field isn't aligned, split off and free the blocks's
+    // front, up to the first aligned data field w/room for a block before it
+    size_t data_addr = (size_t)block_getdata(block);
+    if (data_addr & (alignment - 1)) {
+        size_t aligned = (data_addr + MIN_BLOCK_SZ + alignment - 1) &
+                         ~(alignment - 1);
+        BlockHead *aligned_block = block_getheader((void*)aligned);
+        size_t lead_sz = aligned - data_addr;
+
+        aligned_block->size = (block_size(block) - lead_sz) | BLOCK_USED |
+                              (block->size & BLOCK_ZEROED);
+        block->size = lead_sz | (block->size & BLOCK_FLAGS);
+        block_add_tofree(block);
+        g_heap->stats.alloc_sz -= lead_sz;
+
+        block = aligned_block;
+    }
+
+    // Give back any excess at the block's end
+    block_chunk(block, size);
+
+    block->size &= ~(size_t)BLOCK_ZEROED;
+    return block_getdata(block);
+}
+
+/* -- do_usable_size -- */
+// RETURNS: The num of bytes usable in the allocated data field at ptr.
+static size_t do_usable_size(void *ptr) {
+    if (!ptr)
+        return 0;
+    if (slab_owns(ptr))
+        return slab_desc(ptr)->slot_sz;
+    return block_datasize(block_getheader(ptr));
+}
+
 /* Begin do_malloc, do_calloc, do_realloc, do_free ----------------------DF */
+/* Begin Arena Helpers ---------------------------------------------------- */
+
+
+/* -- arena_fork_prepare, arena_fork_parent, arena_fork_child -- */
+// Hold every arena's lock, then every slab heap's, across fork, so no other
+// thread - the background one or any of the program's - can leave one locked,
+// and its heap half-updated, in the child. There are no more slab heaps than
+// arenas. The child has no background thread, so its next malloc starts one
+// anew.
+static void arena_fork_prepare() {
+    for (size_t i = 0; i < g_arena_count; i++)
+        pthread_mutex_lock(&g_arenas[i].lock);
+    for (size_t i = 0; i < g_arena_count; i++)
+        pthread_mutex_lock(&g_slabs[i].lock);
+}
+
+static void arena_fork_parent() {
+    for (size_t i = 0; i < g_arena_count; i++)
+        pthread_mutex_unlock(&g_slabs[i].lock);
+    for (size_t i = 0; i < g_arena_count; i++)
+        pthread_mutex_unlock(&g_arenas[i].lock);
+}
+
+static void arena_fork_child() {
+    if (g_bg_state == BG_STARTING || g_bg_state == BG_RUNNING)
+        g_bg_state = BG_WANTED;
+    for (size_t i = 0; i < g_arena_count; i++)
+        pthread_mutex_unlock(&g_slabs[i].lock);
+    for (size_t i = 0; i < g_arena_count; i++)
+        pthread_mutex_unlock(&g_arenas[i].lock);
+}
+
+/* -- arena_init -- */
+// Settles the num of arenas, and reserves the addresses for their slots.
+//      Falls back to one arena, w/o a slot, if there's to be a pool, if
+//      g_reserve_sz is too small to hold a heap, or if the addresses can't
+//      be reserved. Registers the fork handlers above, whether or not the
+//      background thread is to run.
+static void arena_init() {
+    config_init();
+
+    size_t count = g_arena_count;
+    if (!count) {
+        cpu_set_t cpus;
+        count = sched_getaffinity(0, sizeof(cpus), &cpus) ?
+                1 : (size_t)CPU_COUNT(&cpus);
+        if (count > ARENA_MAX)
+            count = ARENA_MAX;
+    }
+    if (g_pool_sz || g_reserve_sz <= START_HEAP_SZ ||
+        g_reserve_sz > (size_t)-1 / count)
+        count = 1;
+
+    char *base = count > 1 ? do_reserve(count * g_reserve_sz) : NULL;
+    if (!base)
+        count = 1;
+    for (size_t i = 0; base && i < count; i++)
+        g_arenas[i].slot = base + i * g_reserve_sz;
+
+    g_arena_base = base;
+    g_arena_count = count;
+    pthread_atfork(arena_fork_prepare, arena_fork_parent, arena_fork_child);
+}
+
+/* -- arena_of -- */
+// Returns: The arena that owns the given data field's block, or NULL if it's
+//      not a block of a heap, but a slab object, a span or a huge block.
+static Arena *arena_of(void *ptr) {
+    if (slab_owns(ptr) || block_getheader(ptr)->size & BLOCK_MMAPPED)
+        return NULL;
+    if (g_arena_count < 2)
+        return g_arenas;
+
+    size_t i = (size_t)((char*)ptr - g_arena_base) / g_reserve_sz;
+    return g_arenas + (i < g_arena_count ? i : 0);
+}
+
+/* -- arena_lock -- */
+// Locks the given arena, making its heap g_heap.
+static void arena_lock(Arena *arena) {
+    pthread_mutex_lock(&arena->lock);
+    g_arena = arena;
+    g_heap = arena->heap;
+}
+
+/* -- arena_lock_mine -- */
+// Locks this thread's arena, making its heap g_heap. A thread w/o one yet is
+//      assigned one round-robin. If it's busy, the thread moves to the first
+//      other arena that isn't, and waits for its own only if none is free.
+static void arena_lock_mine() {
+    Arena *arena = t_arena;
+    if (!arena) {
+        pthread_once(&arena_once, arena_init);
+        size_t next = __atomic_fetch_add(&g_arena_next, 1, __ATOMIC_RELAXED);
+        arena = t_arena = g_arenas + next % g_arena_count;
+    }
+
+    if (pthread_mutex_trylock(&arena->lock)) {
+        size_t i = 1;
+        for (; i < g_arena_count; i++) {
+            Arena *other = g_arenas +
+                           ((size_t)(arena - g_arenas) + i) % g_arena_count;
+            if (!pthread_mutex_trylock(&other->lock)) {
+                t_arena = arena = other;
+                break;
+            }
+        }
+        if (i == g_arena_count)
+            pthread_mutex_lock(&arena->lock);
+    }
+
+    g_arena = arena;
+    g_heap = arena->heap;
+}
+
+/* -- arena_unlock -- */
+// Unlocks the arena held, keeping g_heap as its heap, which may have been
+//      set up or freed meanwhile.
+static void arena_unlock() {
+    Arena *arena = g_arena;
+    arena->heap = g_heap;
+    g_heap = NULL;
+    g_arena = NULL;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/* -- arena_retry -- */
+// Moves from the arena held to arena 0 after a request the former couldn't
+//      serve - as its heap is confined to its slot, arena 0's may still.
+// Returns: Nonzero if it moved, and the request is worth retrying, else 0.
+static int arena_retry() {
+    if (g_arena == g_arenas)
+        return 0;
+
+    arena_unlock();
+    arena_lock(g_arenas);
+    return 1;
+}
+
+/* -- arena_free -- */
+// Frees the given data field, under the lock of the arena that owns it, if
+//      any.
+static void arena_free(void *ptr) {
+    Arena *arena = arena_of(ptr);
+    if (!arena) {
+        do_free(ptr);
+        return;
+    }
+
+    arena_lock(arena);
+    do_free(ptr);
+    arena_unlock();
+}
+
+
+/* End Arena Helpers ------------------------------------------------------ */
+/* Begin Thread Cache Helpers --------------------------------------------- */
+
+
+/* -- tcache_class -- */
+// Returns: The thread cache class that serves requests of "size" bytes.
+// Assumes: 0 < size <= TCACHE_MAX_SZ.
+static size_t tcache_class(size_t size) {
+    return (size - 1) / ALIGN_SZ;
+}
+
+/* -- tcache_holds -- */
+// Returns: The thread cache class the given data field may be cached in, or
+//      TCACHE_BINS if it's too large to be cached.
+static size_t tcache_holds(void *ptr) {
+    size_t cls = do_usable_size(ptr) / ALIGN_SZ - 1;
+    return cls < TCACHE_BINS ? cls : TCACHE_BINS;
+}
+
+/* -- tcache_key_init -- */
+// Creates the key whose destructor flushes a thread's cache at thread exit.
+static void tcache_destroy(void *arg);
+static void tcache_key_init() {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/* -- tcache_ready -- */
+// Sets up this thread's cache on first use.
+// Returns: Nonzero iff the cache may be used.
+static int tcache_ready() {
+    if (t_cache.state == TCACHE_READY)
+        return 1;
+    if (t_cache.state != TCACHE_UNINIT)
+        return 0;
+
+    // The pthread calls below may recurse into malloc - those get served
+    // from the heap while we're in the INITING state.
+    t_cache.state = TCACHE_INITING;
+    pthread_once(&tcache_key_once, tcache_key_init);
+    pthread_setspecific(tcache_key, &t_cache);
+    t_cache.state = TCACHE_READY;
+
+    return 1;
+}
+
+/* -- tcache_push -- */
+// Adds the block w/the given data field to the given class's cached list.
+static void tcache_push(size_t cls, void *ptr) {
+    *(void**)ptr = t_cache.bins[cls];
+    t_cache.bins[cls] = ptr;
+    t_cache.counts[cls]++;
+}
+
+/* -- tcache_pop -- */
+// Removes the most recently cached data field from the given class's list.
+// Returns: The data field removed, or NULL if the list is empty.
+static void *tcache_pop(size_t cls) {
+    void *ptr = t_cache.bins[cls];
+    if (ptr) {
+        t_cache.bins[cls] = *(void**)ptr;
+        t_cache.counts[cls]--;
+    }
+    return ptr;
+}
+
+/* -- tcache_get -- */
+// Takes a data field of at least "size" bytes from this thread's cache.
+// Returns: A ptr to the data field on success, else NULL.
+static void *tcache_get(size_t size) {
+    if (!size || size > TCACHE_MAX_SZ || !tcache_ready())
+        return NULL;
+    return tcache_pop(tcache_class(size));
+}
+
+/* -- tcache_put -- */
+// Caches the given data field in this thread's cache, if there's room.
+// Returns: Nonzero if the data field was cached, else 0.
+static int tcache_put(void *ptr) {
+    size_t cls = tcache_holds(ptr);
+
+    if (cls == TCACHE_BINS || !tcache_ready())
+        return 0;
+
+    if (t_cache.counts[cls] >= TCACHE_BIN_MAX)
+        return 0;
+
+    tcache_push(cls, ptr);
+    return 1;
+}
+
+/* -- tcache_refill -- */
+// Allocates a batch of blocks of "size" bytes' class from g_heap, caching all
+//      but one of them in this thread's cache.
+// Assumes: An arena is held.
+// Returns: A ptr to the uncached block's data field, else NULL.
+static void *tcache_refill(size_t size) {
+    if (!size || size > TCACHE_MAX_SZ || t_cache.state != TCACHE_READY)
+        return NULL;
+
+    // Size the data fields to serve any request of the class
+    size_t cls = tcache_class(size);
+    size_t cls_sz = (cls + 1) * ALIGN_SZ;
+    void *ptr = do_malloc(cls_sz);
+
+    for (int i = 1; ptr && i < TCACHE_BATCH; i++) {
+        void *extra = do_malloc(cls_sz);
+        if (!extra)
+            break;
+        tcache_push(cls, extra);
+    }
+
+    return ptr;
+}
+
+/* -- tcache_flush -- */
+// Returns up to "count" blocks of the given class from this thread's cache to
+//      the "free" lists of the arenas that own them, holding each arena for
+//      as long as the blocks freed in a row are its.
+// Assumes: No arena is held.
+static void tcache_flush(size_t cls, unsigned int count) {
+    Arena *held = NULL;
+    while (count--) {
+        void *ptr = tcache_pop(cls);
+        if (!ptr)
+            break;
+
+        Arena *arena = arena_of(ptr);
+        if (arena && arena != held) {
+            if (held)
+                arena_unlock();
+            arena_lock(arena);
+            held = arena;
+        }
+        do_free(ptr);
+    }
+    if (held)
+        arena_unlock();
+}
+
+/* -- tcache_release -- */
+// Caches the given data field, whose class list is full, after making room by
+//      returning a batch of that class's blocks to their arenas.
+// Assumes: No arena is held.
+// Returns: Nonzero if the data field was cached, else 0.
+static int tcache_release(void *ptr) {
+    size_t cls = tcache_holds(ptr);
+
+    if (cls == TCACHE_BINS || t_cache.state != TCACHE_READY)
+        return 0;
+
+    // Flush before caching the block, as the flush takes the most recently
+    // cached blocks first. The block just freed, likely still in the CPU's
+    // cache, is then the first to serve the next malloc of its class.
+    tcache_flush(cls, TCACHE_BATCH);
+    tcache_push(cls, ptr);
+
+    return 1;
+}
+
+/* -- tcache_destroy -- */
+// Returns all of an exiting thread's cached blocks to their arenas, then does
+//      its own arena's upkeep.
+static void tcache_destroy(void *arg) {
+    for (size_t cls = 0; cls < TCACHE_BINS; cls++)
+        tcache_flush(cls, t_cache.counts[cls]);
+    t_cache.state = TCACHE_DEAD;
+    if (!bg_running() && !g_pool_sz && t_arena) {
+        arena_lock(t_arena);
+        heap_trim_idle();
+        heap_decay(PURGE_BATCH);
+        arena_unlock();
+    }
+}
+
+
+/* End Thread Cache Helpers ----------------------------------------------- */
+/* Begin Background Helpers ----------------------------------------------- */
+
+
+/* -- bg_running -- */
+// Returns: Nonzero iff the background thread is doing the heap's upkeep.
+static int bg_running() {
+    return __atomic_load_n(&g_bg_state, __ATOMIC_RELAXED) == BG_RUNNING;
+}
+
+/* -- bg_want -- */
+// Has the next malloc start the background thread, if it's wanted.
+static void bg_want() {
+    if (g_bg_ms && !g_pool_sz)
+        __atomic_compare_exchange_n(&g_bg_state, &(int){ BG_OFF }, BG_WANTED,
+                                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* -- bg_main -- */
+// The background thread. Every g_bg_ms, for each arena in turn, purges its
+//      heap's decayed free blocks, unmaps its wholly free mappings beyond
+//      what it keeps, frees it if it's been idle for long enough, and expands
+//      it ahead of demand.
+static void *bg_main(void *arg) {
+    struct timespec tick = { (time_t)(g_bg_ms / 1000),
+                             (long)(g_bg_ms % 1000) * 1000000 };
+
+    for (;;) {
+        nanosleep(&tick, NULL);
+
+        for (size_t i = 0; i < g_arena_count; i++) {
+            arena_lock(g_arenas + i);
+            if (g_heap && g_heap->stats.alloc_count &&
+                g_heap->stats.mapped_sz > heap_keep_sz())
+                heap_shrink(heap_keep_sz());
+            heap_trim_idle();
+            heap_decay((size_t)-1);
+            BlockHead *block = heap_ahead();
+            size_t size = block ? block_size(block) : 0;
+            arena_unlock();
+
+            if (block && g_prefault)
+                heap_prefault((char*)block + sizeof(BlockHead),
+                              size - sizeof(BlockHead));
+        }
+    }
+    return NULL;
+}
+
+/* -- bg_start -- */
+// Starts the background thread, if it's wanted and not already started.
+// Assumes: No arena is held by the caller.
+static void bg_start() {
+    // The pthread calls below may recurse into malloc - those see the
+    // STARTING state and go on w/o us.
+    if (!__atomic_compare_exchange_n(&g_bg_state, &(int){ BG_WANTED },
+                                     BG_STARTING, 0, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+        return;
+
+    // The thread blocks all signals, so they're left to the program's own
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int err = pthread_attr_init(&attr);
+    if (!err) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        err = pthread_create(&thread, &attr, bg_main, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        pthread_attr_destroy(&attr);
+    }
+
+    __atomic_store_n(&g_bg_state, err ? BG_FAILED : BG_RUNNING,
+                     __ATOMIC_RELAXED);
+}
+
+/* -- bg_check -- */
+// Starts the background thread if bg_want has asked for it.
+static void bg_check() {
+    if (__atomic_load_n(&g_bg_state, __ATOMIC_RELAXED) == BG_WANTED)
+        bg_start();
+}
+
+
+/* End Background Helpers ------------------------------------------------- */
 /* End of your helper functions */
 
 /* Start of the actual malloc/calloc/realloc/free functions */
 
 void __free_impl(void *ptr) {
-    do_free(ptr);
+    if (!ptr || tcache_release(ptr))
+        return;
+    arena_free(ptr);
 }
 
 void *__malloc_impl(size_t size) {
-    return do_malloc(size);
+    arena_lock_mine();
+    void *ptr = tcache_refill(size);
+    if (!ptr)
+        ptr = do_malloc(size);
+    if (!ptr && size && arena_retry())
+        ptr = do_malloc(size);
+    arena_unlock();
+    return ptr;
 }
 
 void *__calloc_impl(size_t nmemb, size_t size) {
-    return do_calloc(nmemb, size);
+    arena_lock_mine();
+    void *ptr = do_calloc(nmemb, size);
+    if (!ptr && sizet_multiply(nmemb, size) && arena_retry())
+        ptr = do_calloc(nmemb, size);
+    arena_unlock();
+    return ptr;
 }
 
 void *__realloc_impl(void *ptr, size_t size) {
-  return do_realloc(ptr, size);
+    // A heap's block is resized, or moved, within the arena that owns it if
+    // able, else moved to arena 0
+    Arena *arena = ptr ? arena_of(ptr) : NULL;
+    if (arena)
+        arena_lock(arena);
+    else
+        arena_lock_mine();
+    void *result = do_realloc(ptr, size);
+    int moved = 0;
+    if (!result && size && arena_retry()) {
+        if (arena) {
+            result = do_malloc(size);
+            moved = result != NULL;
+        } else {
+            result = do_realloc(ptr, size);
+        }
+    }
+    arena_unlock();
+
+    // A block moved out of its arena is copied, then freed under that
+    // arena's lock, w/o holding arena 0's
+    if (moved) {
+        size_t old_sz = do_usable_size(ptr);
+        mem_cpy(result, ptr, size < old_sz ? size : old_sz);
+        arena_free(ptr);
+    }
+    return result;
+}
+
+void *__memalign_impl(size_t alignment, size_t size) {
+    // Non power of two alignments are rounded up to the next power of two
+    if (alignment > ((size_t)-1 >> 1) + 1)
+        return NULL;
+    if (alignment & (alignment - 1))
+        alignment = (size_t)1 << (BINMAP_BITS - __builtin_clzl(alignment));
+
+    arena_lock_mine();
+    void *ptr = do_memalign(alignment, size);
+    if (!ptr && size && arena_retry())
+        ptr = do_memalign(alignment, size);
+    arena_unlock();
+    return ptr;
+}
+
+void *__valloc_impl(size_t size) {
+    return __memalign_impl(PAGE_SZ, size);
+}
+
+void *__pvalloc_impl(size_t size) {
+    if (size > (size_t)-1 - PAGE_SZ)
+        return NULL;
+    return __memalign_impl(PAGE_SZ,
+                           (size + PAGE_SZ - 1) & ~(size_t)(PAGE_SZ - 1));
+}
+
+size_t __usable_size_impl(void *ptr) {
+    return do_usable_size(ptr);
+}
+
+int __mallopt_impl(int param, int value) {
+    if (value < 0)
+        return 0;
+
+    switch (param) {
+        case M_MMAP_THRESHOLD:
+            if (value > MMAP_THRESHOLD_MAX)
+                return 0;
+            __atomic_store_n(&g_mmap_threshold, (size_t)value,
+                             __ATOMIC_RELAXED);
+            __atomic_store_n(&g_mmap_threshold_fixed, 1, __ATOMIC_RELAXED);
+            return 1;
+        case M_TRIM_THRESHOLD:
+            __atomic_store_n(&g_retain_sz, (size_t)value, __ATOMIC_RELAXED);
+            return 1;
+    }
+    return 0;
+}
+
+int __trim_impl(size_t pad) {
+    if (g_pool_sz)
+        return 0;
+
+    // Trim each arena's heap to "pad" bytes
+    int trimmed = 0;
+    for (size_t i = 0; i < g_arena_count; i++) {
+        arena_lock(g_arenas + i);
+        if (g_heap) {
+            size_t mapped_sz = g_heap->stats.mapped_sz;
+            heap_shrink(pad);
+            trimmed |= !g_heap || g_heap->stats.mapped_sz < mapped_sz;
+        }
+        arena_unlock();
+    }
+    return trimmed;
+}
+
+void __stats_impl(MemStats *stats) {
+    MemStats empty = { 0 };
+    *stats = empty;
+
+    // Sum the heap stats of every arena
+    for (size_t i = 0; i < g_arena_count; i++) {
+        pthread_mutex_lock(&g_arenas[i].lock);
+        HeapHead *heap = g_arenas[i].heap;
+        if (heap) {
+            stats->mapped_sz += heap->stats.mapped_sz;
+            stats->map_count += heap->stats.map_count;
+            stats->alloc_sz += heap->stats.alloc_sz;
+            stats->alloc_count += heap->stats.alloc_count;
+            stats->free_sz += heap->stats.free_sz;
+            stats->free_count += heap->stats.free_count;
+        }
+        pthread_mutex_unlock(&g_arenas[i].lock);
+    }
+
+    // And of every slab heap - those not in use are all zero
+    for (size_t i = 0; i < g_arena_count; i++) {
+        slab_lock(g_slabs + i);
+        stats->slab_sz += (g_slab->slab_pages - g_slab->purged_count) *
+                          PAGE_SZ;
+        stats->slab_count += g_slab->obj_count;
+        stats->span_sz += g_slab->span_sz;
+        stats->span_count += g_slab->span_count;
+        slab_unlock();
+    }
+    stats->huge_sz = __atomic_load_n(&g_huge_sz, __ATOMIC_RELAXED);
+    stats->huge_count = __atomic_load_n(&g_huge_count, __ATOMIC_RELAXED);
+}
+
+/* Lock-free fast paths, tried by memory.c before the above, which take the
+   locks they need. Each one returns NULL (or 0) when the request must be
+   served by the above instead. */
+
+void *__malloc_fast_impl(size_t size) {
+    bg_check();
+    if (size && huge_wanted(size) && !span_wanted(size))
+        return huge_alloc(size);
+    return tcache_get(size);
+}
+
+void *__calloc_fast_impl(size_t nmemb, size_t size) {
+    size_t total_sz = sizet_multiply(nmemb, size);
+    bg_check();
+
+    // Fresh mappings are already zeroed
+    if (total_sz && huge_wanted(total_sz) && !span_wanted(total_sz))
+        return huge_alloc(total_sz);
+
+    void *ptr = tcache_get(total_sz);
+
+    if (ptr)
+        mem_set(ptr, 0, total_sz);
+    return ptr;
+}
+
+int __realloc_fast_impl(void *ptr, size_t size, void **result) {
+    if (!ptr || !size || !huge_wanted(size) || slab_owns(ptr))
+        return 0;
+
+    BlockHead *block = block_getheader(ptr);
+    if (!(block->size & BLOCK_MMAPPED))
+        return 0;
+
+    *result = huge_realloc(block, size);
+    return 1;
+}
+
+int __free_fast_impl(void *ptr) {
+    if (!ptr)
+        return 1;
+    if (slab_owns(ptr))
+        return tcache_put(ptr);
+
+    BlockHead *block = block_getheader(ptr);
+    if (block->size & BLOCK_MMAPPED) {
+        huge_free(block);
+        return 1;
+    }
+    return tcache_put(ptr);
 }
 
 /* End of the actual malloc/calloc/realloc/free functions */
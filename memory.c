@@ -80,19 +80,33 @@
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <malloc.h>
+#include <errno.h>
+
+#include "memory.h"
 
 
 void *__malloc_impl(size_t);
 void *__calloc_impl(size_t, size_t);
 void *__realloc_impl(void *, size_t);
 void __free_impl(void *);
+void *__memalign_impl(size_t, size_t);
+void *__valloc_impl(size_t);
+void *__pvalloc_impl(size_t);
+size_t __usable_size_impl(void *);
+void *__malloc_fast_impl(size_t);
+void *__calloc_fast_impl(size_t, size_t);
+int __realloc_fast_impl(void *, size_t, void **);
+int __free_fast_impl(void *);
+void __stats_impl(MemStats *);
+int __mallopt_impl(int, int);
+int __trim_impl(size_t);
 
 static int __memory_print_debug_running = 0;
 static int __memory_print_debug_init_running = 0;
 static int __memory_print_debug_initialized = 0;
 static int __memory_print_debug_do_it = 0;
 
-static pthread_mutex_t memory_management_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static void __memory_print_debug_init() {
@@ -135,9 +149,9 @@ static void __memory_print_debug(const char *fmt, ...) {
 void *malloc(size_t size) {
   void *ptr;
   __memory_print_debug("TRYING: malloc(%u)\n", size);
-  pthread_mutex_lock(&memory_management_lock);
-  ptr = __malloc_impl(size);
-  pthread_mutex_unlock(&memory_management_lock);
+  ptr = __malloc_fast_impl(size);
+  if (ptr == NULL)
+    ptr = __malloc_impl(size);
   __memory_print_debug("RESULT: malloc(%u) = %u\n", size, ptr);
   return ptr;
 }
@@ -146,9 +160,9 @@ void *calloc(size_t nmemb, size_t size) {
   void *ptr;
 
   __memory_print_debug("TRYING: calloc(%u, %u)\n", nmemb, size);
-  pthread_mutex_lock(&memory_management_lock);
-  ptr = __calloc_impl(nmemb, size);
-  pthread_mutex_unlock(&memory_management_lock);
+  ptr = __calloc_fast_impl(nmemb, size);
+  if (ptr == NULL)
+    ptr = __calloc_impl(nmemb, size);
   __memory_print_debug("RESULT: calloc(%u, %u) = %u\n", nmemb, size, ptr);
   return ptr;
 }
@@ -157,18 +171,100 @@ void *realloc(void *old_ptr, size_t size) {
   void *ptr;
 
   __memory_print_debug("TRYING: realloc(%u, %u)\n", old_ptr, size);
-  pthread_mutex_lock(&memory_management_lock);
-  ptr = __realloc_impl(old_ptr, size);
-  pthread_mutex_unlock(&memory_management_lock);
+  if (!__realloc_fast_impl(old_ptr, size, &ptr))
+    ptr = __realloc_impl(old_ptr, size);
   __memory_print_debug("RESULT: realloc(%u, %u) = %u\n", old_ptr, size, ptr);
   return ptr;
 }
 
 void free(void *ptr) {
   __memory_print_debug("TRYING: free(%u)\n", ptr);
-  pthread_mutex_lock(&memory_management_lock);
-  __free_impl(ptr);
-  pthread_mutex_unlock(&memory_management_lock);
+  if (!__free_fast_impl(ptr))
+    __free_impl(ptr);
   __memory_print_debug("RESULT: free(%u)\n", ptr);
 }
 
+void *memalign(size_t alignment, size_t size) {
+  void *ptr;
+
+  __memory_print_debug("TRYING: memalign(%u, %u)\n", alignment, size);
+  ptr = __memalign_impl(alignment, size);
+  __memory_print_debug("RESULT: memalign(%u, %u) = %u\n", alignment, size, ptr);
+  return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (alignment == 0 || (alignment & (alignment - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  void *ptr;
+
+  if (alignment % sizeof(void *) || alignment == 0 ||
+      (alignment & (alignment - 1)))
+    return EINVAL;
+  ptr = memalign(alignment, size);
+  if (ptr == NULL && size)
+    return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void *valloc(size_t size) {
+  void *ptr;
+
+  __memory_print_debug("TRYING: valloc(%u)\n", size);
+  ptr = __valloc_impl(size);
+  __memory_print_debug("RESULT: valloc(%u) = %u\n", size, ptr);
+  return ptr;
+}
+
+void *pvalloc(size_t size) {
+  void *ptr;
+
+  __memory_print_debug("TRYING: pvalloc(%u)\n", size);
+  ptr = __pvalloc_impl(size);
+  __memory_print_debug("RESULT: pvalloc(%u) = %u\n", size, ptr);
+  return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+  return __usable_size_impl(ptr);
+}
+
+void mem_stats(MemStats *stats) {
+  __stats_impl(stats);
+}
+
+struct mallinfo2 mallinfo2(void) {
+  struct mallinfo2 info = { 0 };
+  MemStats stats;
+
+  mem_stats(&stats);
+  info.arena = stats.mapped_sz + stats.slab_sz + stats.span_sz;
+  info.ordblks = stats.free_count;
+  info.uordblks = stats.alloc_sz;
+  info.fordblks = stats.free_sz;
+  info.hblks = stats.huge_count;
+  info.hblkhd = stats.huge_sz;
+  return info;
+}
+
+int mallopt(int param, int value) {
+  int result;
+
+  result = __mallopt_impl(param, value);
+  return result;
+}
+
+int malloc_trim(size_t pad) {
+  int result;
+
+  result = __trim_impl(pad);
+  return result;
+}
+
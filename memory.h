@@ -0,0 +1,40 @@
+/*  
+
+    Public extensions of the memory manager, beyond the standard
+    malloc/calloc/realloc/free interface it replaces.
+
+    Contributor: Dustin Fast
+
+*/
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+// Live heap counters, kept up to date on every malloc, free and split.
+// Blocks held in thread caches are counted as allocated. Blocks large enough
+// to get a mapping of their own are counted only in huge_sz and huge_count,
+// objects small enough for a slab only in slab_sz and slab_count, and those
+// served as runs of whole pages only in span_sz and span_count.
+typedef struct MemStats {
+    size_t mapped_sz;       // Total bytes mapped from the kernel
+    size_t map_count;       // Num of mappings backing the heap
+    size_t alloc_sz;        // Total sz of allocated blocks, w/headers
+    size_t alloc_count;     // Num of allocated blocks
+    size_t free_sz;         // Total sz of free blocks, w/headers
+    size_t free_count;      // Num of free blocks
+    size_t huge_sz;         // Total sz of blocks mmapped on their own
+    size_t huge_count;      // Num of blocks mmapped on their own
+    size_t slab_sz;         // Total sz of pages used as slabs
+    size_t slab_count;      // Num of objects allocated from slabs
+    size_t span_sz;         // Total sz of allocated spans of pages
+    size_t span_count;      // Num of allocated spans of pages
+} MemStats;
+
+// Fills "stats" with the heap counters, summed over every arena. Each arena's
+// counters, and the slabs', are read under their own lock, one at a time, so
+// while other threads allocate, the totals may mix counts from moments apart.
+void mem_stats(MemStats *stats);
+
+#endif
@@ -0,0 +1,174 @@
+// Allocation trace recorder, for replay by benchfit.c. Preloaded into a
+// program, it passes each malloc, calloc, realloc and free on to the next
+// allocator in line (normally the c stdlib's), and records the call, its
+// args and its result to $TRACE_DIR/trace.<pid>.
+//
+// Build it, then run a program under it like so:
+//
+//      gcc -fPIC -Wall -O2 -shared -o tracerec.so tracerec.c -ldl -lpthread
+//      mkdir -p traces
+//      TRACE_DIR=traces LD_PRELOAD=`pwd`/tracerec.so cc -O2 -c memlib.c
+//
+// Each record is five unsigned longs: the op (0 malloc, 1 free, 2 calloc,
+// 3 realloc), the size (for calloc, the num of elements), the element size
+// (calloc only), the ptr passed in (free and realloc) and the ptr returned.
+//
+// Author: Dustin Fast
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#define REC_BUF_COUNT 4096      // Num of records buffered between writes
+#define BOOT_SZ 65536           // Size of the buffer served during dlsym
+
+typedef struct TraceRec {
+    unsigned long op;           // 0 malloc, 1 free, 2 calloc, 3 realloc
+    unsigned long size;         // Requested size, or calloc's num of elements
+    unsigned long elem_sz;      // calloc's element size, else 0
+    unsigned long ptr;          // ptr passed to free or realloc, else 0
+    unsigned long result;       // ptr returned, else 0
+} TraceRec;
+
+// The next allocator's functions
+static void *(*next_malloc)(size_t);
+static void (*next_free)(void*);
+static void *(*next_calloc)(size_t, size_t);
+static void *(*next_realloc)(void*, size_t);
+
+static int trace_fd = -1;
+static TraceRec recs[REC_BUF_COUNT];
+static int rec_count = 0;
+static pthread_mutex_t rec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// dlsym may itself allocate. Those requests, made before the next allocator
+// is known, are served from here and never recorded or freed.
+static char boot_buf[BOOT_SZ] __attribute__((aligned(16)));
+static size_t boot_used = 0;
+static __thread int t_in_init = 0;
+
+/* -- boot_alloc -- */
+// Returns: ptr to "size" bytes of the boot buffer, or NULL if it's used up.
+static void *boot_alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > BOOT_SZ)
+        return NULL;
+    void *ptr = boot_buf + boot_used;
+    boot_used += size;
+    return ptr;
+}
+
+/* -- is_boot -- */
+// Returns: Nonzero iff ptr lies in the boot buffer.
+static int is_boot(void *ptr) {
+    return (char*)ptr >= boot_buf && (char*)ptr < boot_buf + BOOT_SZ;
+}
+
+/* -- rec_init -- */
+// Finds the next allocator's functions and opens the trace file.
+static void rec_init() {
+    t_in_init = 1;
+    next_malloc = dlsym(RTLD_NEXT, "malloc");
+    next_free = dlsym(RTLD_NEXT, "free");
+    next_calloc = dlsym(RTLD_NEXT, "calloc");
+    next_realloc = dlsym(RTLD_NEXT, "realloc");
+
+    char *dir = getenv("TRACE_DIR");
+    if (dir) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/trace.%d", dir, (int)getpid());
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    t_in_init = 0;
+}
+
+/* -- rec_flush -- */
+// Writes the buffered records to the trace file. Caller must hold rec_lock.
+static void rec_flush() {
+    if (trace_fd >= 0 && rec_count)
+        if (write(trace_fd, recs, rec_count * sizeof(TraceRec)) < 0)
+            trace_fd = -1;
+    rec_count = 0;
+}
+
+/* -- rec_add -- */
+// Buffers a record of the given call.
+static void rec_add(unsigned long op, size_t size, size_t elem_sz,
+                    void *ptr, void *result) {
+    if (t_in_init || trace_fd < 0)
+        return;
+
+    pthread_mutex_lock(&rec_lock);
+    TraceRec *rec = &recs[rec_count++];
+    rec->op = op;
+    rec->size = size;
+    rec->elem_sz = elem_sz;
+    rec->ptr = (unsigned long)ptr;
+    rec->result = (unsigned long)result;
+    if (rec_count == REC_BUF_COUNT)
+        rec_flush();
+    pthread_mutex_unlock(&rec_lock);
+}
+
+/* -- rec_fini -- */
+// Writes any records still buffered when the program exits.
+__attribute__((destructor))
+static void rec_fini() {
+    pthread_mutex_lock(&rec_lock);
+    rec_flush();
+    pthread_mutex_unlock(&rec_lock);
+}
+
+void *malloc(size_t size) {
+    if (!next_malloc) {
+        if (t_in_init)
+            return boot_alloc(size);
+        rec_init();
+    }
+    void *result = next_malloc(size);
+    rec_add(0, size, 0, NULL, result);
+    return result;
+}
+
+void free(void *ptr) {
+    if (is_boot(ptr))
+        return;
+    if (!next_free)
+        rec_init();
+    rec_add(1, 0, 0, ptr, NULL);
+    next_free(ptr);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (!next_calloc) {
+        if (t_in_init)
+            return boot_alloc(nmemb * size);    // Boot buffer is zeroed
+        rec_init();
+    }
+    void *result = next_calloc(nmemb, size);
+    rec_add(2, nmemb, size, NULL, result);
+    return result;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!next_realloc)
+        rec_init();
+
+    // A boot block's size is unknown, but the boot buffer bounds it
+    if (is_boot(ptr)) {
+        void *result = next_malloc(size);
+        size_t room = boot_buf + BOOT_SZ - (char*)ptr;
+        if (result)
+            memcpy(result, ptr, size < room ? size : room);
+        return result;
+    }
+
+    void *result = next_realloc(ptr, size);
+    rec_add(3, size, 0, ptr, result);
+    return result;
+}